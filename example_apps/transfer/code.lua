@@ -10,6 +10,11 @@ CHUNK=1024 * 64
 sfiles = {}
 gfiles = {}
 
+-- chunks the connection had no room for, sent again by the retry timer
+pending = {}
+retry = app:timer(50, "send_pending()")
+retry:stop()
+
 s:when_clicked("send()")
 app:when_message("sf", "got_start_file")
 app:when_message("gc","got_get_chunk")
@@ -201,12 +206,27 @@ function send_chunk(to, f, c)
 
 	local m = app:message()
 	m:set_type("sc")
+	m:set_priority("bulk")
 	m:set("m", {id=f.id, chunk=c})
 	m:set_bin("data", ch)
-	app:send_to(to, m)
+	if #pending > 0 or not app:try_send_to(to, m) then
+		table.insert(pending, {to=to, msg=m})
+		retry:start()
+	end
 	update_s_status(sfiles[f.id])
 end
 
+function send_pending()
+	while #pending > 0 do
+		local p = pending[1]
+		if not app:try_send_to(p.to, p.msg) then
+			return
+		end
+		table.remove(pending, 1)
+	end
+	retry:stop()
+end
+
 function got_chunk(m)
 	local md = m:get("m")
 	local id = m:from():id() .. "_" .. md.id
@@ -31,6 +31,7 @@ function got_sound(d)
 	tick = tick + 1
 	local m = app:message()
 	m:not_robust()
+	m:set_priority("realtime")
 	m:set_type("s")
 	m:set("t", tick)
 	m:set_bin("d", d)
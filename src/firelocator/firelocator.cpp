@@ -61,7 +61,7 @@ namespace sc = fire::security;
 namespace
 {
     const size_t THREAD_SLEEP = 100; //in milliseconds
-    const size_t POOL_SIZE = 10; //small pool size for now
+    const size_t POOL_SIZE = 10; //most outgoing tcp connections open at once
 }
 
 po::options_description create_descriptions()
@@ -76,6 +76,8 @@ po::options_description create_descriptions()
         ("help", "prints help")
         ("host", po::value<std::string>()->default_value(host), "host/ip of this server") 
         ("port", po::value<int>()->default_value(port), "port this server will receive messages on")
+        ("udp_shards", po::value<int>()->default_value(1), "udp sockets and threads receiving on the port")
+        ("udp_upload_rate", po::value<int>()->default_value(0), "udp upload cap in bytes per second, 0 is no cap")
         ("pass", po::value<std::string>(), "password to decrypt private key")
         ("key", po::value<std::string>()->default_value(private_key), "path to private key file");
 
@@ -315,13 +317,20 @@ int main(int argc, char *argv[])
 
     auto host = vm["host"].as<std::string>();
     auto port = vm["port"].as<int>();
+    auto udp_shards = vm["udp_shards"].as<int>();
+    auto udp_upload_rate = vm["udp_upload_rate"].as<int>();
     auto pass = vm.count("pass") ? vm["pass"].as<std::string>() : prompt_pass();
     auto key = vm["key"].as<std::string>();
 
     auto pkey = load_private_key(key, pass);
     CHECK(pkey);
 
-    n::connection_manager con{POOL_SIZE, static_cast<n::port_type>(port)};
+    n::connection_manager con{
+        POOL_SIZE, 
+        static_cast<n::port_type>(port), 
+        true, 
+        static_cast<size_t>(std::max(udp_shards, 1)),
+        static_cast<size_t>(std::max(udp_upload_rate, 0))};
     sc::encrypted_channels sec{*pkey};
     user_info_map users;
 
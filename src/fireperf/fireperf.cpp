@@ -34,6 +34,7 @@
 #include <fstream>
 #include <termios.h>
 #include <chrono>
+#include <algorithm>
 
 #include <boost/asio/ip/host_name.hpp>
 #include <boost/program_options.hpp>
@@ -58,6 +59,7 @@ namespace
 {
     const size_t THREAD_SLEEP = 100; //in milliseconds
     const size_t POOL_SIZE = 1; //small pool size for now
+    const auto RECEIVE_WAIT = std::chrono::milliseconds(100);
     n::port_type SRC_PORT = 7170;
     n::port_type DST_PORT = 7171;
     const std::string DST_ADDR = "udp://localhost:7171";
@@ -73,6 +75,7 @@ po::options_description create_descriptions()
         ("help", "prints help")
         ("messages", po::value<int>()->default_value(100000), "Number of messages")
         ("robust", po::value<bool>()->default_value(true), "Are messages robust?")
+        ("fec", po::value<int>()->default_value(0), "Chunks per parity chunk, 0 is off")
         ("size", po::value<int>()->default_value(512), "Message size in bytes");
 
     return d;
@@ -100,6 +103,7 @@ int main(int argc, char *argv[])
     auto iterations = vm["messages"].as<int>();
     auto total_iterations = iterations;
     auto robust = vm["robust"].as<bool>();
+    size_t fec = std::max(vm["fec"].as<int>(), 0);
     size_t bytes_per_message = vm["size"].as<int>();
 
     n::connection_manager src{POOL_SIZE, static_cast<n::port_type>(SRC_PORT)};
@@ -116,8 +120,8 @@ int main(int argc, char *argv[])
     while(iterations)
     try
     {
-        src.send(DST_ADDR, data, robust);
-        while(!dst.receive(ep, got_data)); //spin until we get something
+        src.send(DST_ADDR, data, robust, fec);
+        while(!dst.receive(ep, got_data, RECEIVE_WAIT)); //wait until we get something
 
         CHECK(got_data == data);
         iterations--;
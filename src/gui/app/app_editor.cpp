@@ -89,6 +89,7 @@ namespace fire
                 {"edited_callback", "edit:edited_callback() -- returns the callback used when text is changed"},
                 {"enable", "widget:enable() -- enables the widget"},
                 {"enabled", "widget:enabled() -- returns true if the widget is enabled"},
+                {"fec", "message:fec(chunks) -- sends a parity chunk for every few chunks so a lost chunk is rebuilt instead of resent. Use for data that should arrive quickly"},
                 {"finished_callback","edit:finished_callback() -- returns the callback used when enter is pressed"},
                 {"from", "message:from() -- returns the contact who sent the message"},
                 {"from_str", "bin_data:from_str(str) -- converts a string to binary data"},
@@ -140,6 +141,7 @@ namespace fire
                 {"set", "dict:set(key, value) -- stores the value with the key. The value can be any lua type"},
                 {"selected", "dropdown:selected() -- returns the index of the selected item"},
                 {"set_type", "message:set_type(value) -- sets the type of message"},
+                {"set_priority", "message:set_priority(class) -- sets how the message shares the upload. Classes (realtime, interactive, bulk)"},
                 {"set_bin", "dict:set_bin(key, data) -- stores binary data with the key"},
                 {"set_vclock", "dict:set_vclock(key, vclock) -- stores vclock data with the key"},
                 {"set_image", "button:set_image(image) -- sets an image for the button"},
@@ -173,17 +173,21 @@ namespace fire
                 m::post_office_ptr p,
                 us::user_service_ptr us, 
                 s::conversation_service_ptr ss, 
-                const n::udp_stats& udps,
+                udp_stats_getter udps,
+                tcp_stats_getter tcps,
                 QWidget* parent) :
             QDialog{parent},
             _post{p},
             _user_service{us},
             _conversation_service{ss},
-            _udp_stats(udps)
+            _get_udp_stats(udps),
+            _get_tcp_stats(tcps)
         {
             REQUIRE(p);
             REQUIRE(us);
             REQUIRE(ss);
+            REQUIRE(_get_udp_stats);
+            REQUIRE(_get_tcp_stats);
 
             //main layout
             auto* layout = new QVBoxLayout{this};
@@ -280,20 +284,47 @@ namespace fire
             INVARIANT(_udp_stat_text);
             std::stringstream s;
 
+            const auto stats = _get_udp_stats();
+
             double bytes_sent_per_second = 
-                (_udp_stats.bytes_sent - _prev_udp_stats.bytes_sent) * GRAPH_UPDATES_PER_SECOND;
+                (stats.bytes_sent - _prev_udp_stats.bytes_sent) * GRAPH_UPDATES_PER_SECOND;
 
             double bytes_recv_per_second = 
-                (_udp_stats.bytes_recv - _prev_udp_stats.bytes_recv) * GRAPH_UPDATES_PER_SECOND;
+                (stats.bytes_recv - _prev_udp_stats.bytes_recv) * GRAPH_UPDATES_PER_SECOND;
 
             double dropped_per_second = 
-                (_udp_stats.dropped - _prev_udp_stats.dropped) * GRAPH_UPDATES_PER_SECOND;
+                (stats.dropped - _prev_udp_stats.dropped) * GRAPH_UPDATES_PER_SECOND;
+
+            s << " sent: " << (stats.bytes_sent / 1024) << "kb (" << (bytes_sent_per_second / 1024) << "/s)" 
+              << " recv: " << (stats.bytes_recv / 1024) << " kb (" << (bytes_recv_per_second / 1024) << "/s)"
+              << " dropped: " << stats.dropped << " (" << dropped_per_second << "/s)"
+              << " rebuilt: " << stats.rebuilt
+              << " reassembling: " << (stats.reassembly_bytes / 1024) << "kb"
+              << " evicted: " << stats.evicted_stale << " stale " << stats.evicted_full << " full"
+              << " pkts/syscall: " << stats.packets_per_send() << " out " << stats.packets_per_recv() << " in";
+
+            for(const auto& p : stats.peers)
+            {
+                const auto& ps = p.second;
+                s << "\n " << p.first
+                  << " rtt: " << ps.srtt << "ms (min " << ps.min_rtt << ")"
+                  << " loss: " << (ps.loss * 100) << "%"
+                  << " resent: " << ps.resent
+                  << " dup: " << ps.duplicates
+                  << " inflight: " << ps.in_flight << "/" << ps.window
+                  << " reassembling: " << (ps.reassembly_bytes / 1024) << "kb"
+                  << " up: " << (ps.send_rate / 1024) << "kb/s"
+                  << " down: " << (ps.recv_rate / 1024) << "kb/s";
+            }
+
+            const auto tcp = _get_tcp_stats();
+            s << "\n tcp connects: " << tcp.connected << "/" << tcp.attempts
+              << " retried: " << tcp.retried
+              << " gave up: " << tcp.gave_up
+              << " connecting: " << tcp.connecting;
 
-            s << " sent: " << (_udp_stats.bytes_sent / 1024) << "kb (" << (bytes_sent_per_second / 1024) << "/s)" 
-              << " recv: " << (_udp_stats.bytes_recv / 1024) << " kb (" << (bytes_recv_per_second / 1024) << "/s)"
-              << " dropped: " << _udp_stats.dropped << " (" << dropped_per_second << "/s)";
             _udp_stat_text->setText(s.str().c_str());
-            _prev_udp_stats = _udp_stats;
+            _prev_udp_stats = stats;
         }
 
         void debug_win::update_log()
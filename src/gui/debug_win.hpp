@@ -35,11 +35,13 @@
 #include "user/user_service.hpp"
 #include "conversation/conversation_service.hpp"
 #include "message/post_office.hpp"
+#include "network/tcp_queue.hpp"
 #include "network/udp_queue.hpp"
 
 #include "gui/list.hpp"
 
 #include <fstream>
+#include <functional>
 #include <set>
 
 #include <QDialog>
@@ -85,6 +87,8 @@ namespace fire
         };
 
         using added_mailboxes = std::set<std::string>;
+        using udp_stats_getter = std::function<network::udp_stats()>;
+        using tcp_stats_getter = std::function<network::tcp_connect_stats()>;
 
         class debug_win : public QDialog
         {
@@ -94,7 +98,8 @@ namespace fire
                         fire::message::post_office_ptr,
                         user::user_service_ptr, 
                         conversation::conversation_service_ptr, 
-                        const network::udp_stats&,
+                        udp_stats_getter,
+                        tcp_stats_getter,
                         QWidget* parent = nullptr);
 
             public slots:
@@ -124,8 +129,9 @@ namespace fire
                 conversation::conversation_service_ptr _conversation_service;
 
                 //stats
-                const network::udp_stats& _udp_stats;
+                udp_stats_getter _get_udp_stats;
                 network::udp_stats _prev_udp_stats;
+                tcp_stats_getter _get_tcp_stats;
         };
     }
 }
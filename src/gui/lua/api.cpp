@@ -44,6 +44,7 @@
 
 namespace m = fire::message;
 namespace ms = fire::messages;
+namespace n = fire::network;
 namespace us = fire::user;
 namespace s = fire::conversation;
 namespace u = fire::util;
@@ -164,6 +165,7 @@ namespace fire
                     .set("when_quit", &lua_api::set_contact_quit_callback)
                     .set("send", &lua_api::send_all)
                     .set("send_to", &lua_api::send_to)
+                    .set("try_send_to", &lua_api::try_send_to)
                     .set("send_local", &lua_api::send_local)
                     .set("save_file", &lua_api::save_file)
                     .set("open_file", &lua_api::open_file)
@@ -197,6 +199,8 @@ namespace fire
                 SLB::Class<script_message>{"script_message", &manager}
                     .set("from", &script_message::from)
                     .set("not_robust", &script_message::not_robust)
+                    .set("fec", &script_message::fec)
+                    .set("set_priority", &script_message::set_priority)
                     .set("get_bin", &script_message::get_bin)
                     .set("set_bin", &script_message::set_bin)
                     .set("get_vclock", &script_message::get_vclock)
@@ -700,6 +704,21 @@ namespace fire
                 sender->send(c->id(), m);
             }
 
+            bool lua_api::try_send_to(const contact_ref& cr, const script_message& m)
+            {
+                INVARIANT(sender);
+                INVARIANT(conversation);
+
+                auto c = conversation->contacts().by_id(cr.user_id);
+                if(!c) return true;
+
+                auto post = conversation->parent_post().lock();
+                if(!post) return true;
+
+                //false only when the app should wait and try again
+                return sender->try_send(c->id(), m, *post) != n::send_status::would_block;
+            }
+
             size_t lua_api::total_contacts() const
             {
                 INVARIANT(conversation);
@@ -191,6 +191,7 @@ namespace fire
                     void send_simple_event(const std::string& name, const std::string& type);
                     void send_all(const script_message&);
                     void send_to(const contact_ref&, const script_message&); 
+                    bool try_send_to(const contact_ref&, const script_message&); 
                     void send_local(const script_message& m);
 
                     //contacts
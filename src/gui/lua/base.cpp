@@ -334,6 +334,8 @@ namespace fire
                 if(!_type.empty()) m.meta.extra["t"] = _type;
                 m.data = u::encode(_v);
                 m.meta.robust = _robust;
+                m.meta.fec = _fec;
+                m.meta.priority = _priority;
                 return m;
             }
 
@@ -342,6 +344,18 @@ namespace fire
                 _robust = false;
             }
 
+            void script_message::fec(int chunks) 
+            {
+                _fec = chunks > 0 ? chunks : 0;
+            }
+
+            void script_message::set_priority(const std::string& p) 
+            {
+                if(p == "realtime") _priority = m::metadata::realtime;
+                else if(p == "bulk") _priority = m::metadata::bulk;
+                else _priority = m::metadata::interactive;
+            }
+
             const u::value& script_message::get(const std::string& k) const
             {
                 return _v[k];
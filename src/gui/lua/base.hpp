@@ -173,6 +173,8 @@ namespace fire
 
                 public:
                     void not_robust();
+                    void fec(int);
+                    void set_priority(const std::string&);
                     const fire::util::value& get(const std::string&) const;
                     void set(const std::string&, const fire::util::value&);
                     bool has(const std::string&) const;
@@ -193,6 +195,8 @@ namespace fire
                     std::string _local_app_id;
                     util::dict _v;
                     bool _robust = true;
+                    size_t _fec = 0;
+                    fire::message::metadata::priority_type _priority = fire::message::metadata::interactive;
                     lua_api* _api;
             };
 
@@ -740,11 +740,14 @@ namespace fire
             REQUIRE(_user_service);
             REQUIRE(_conversation_service);
 
+            //udp stats are summed over the udp shards each time they are read
+            auto master = _master;
             auto db = new debug_win{
                 _master,
                 _user_service, 
                 _conversation_service, 
-                dynamic_cast<m::master_post_office*>(_master.get())->get_udp_stats()};
+                [master]() { return dynamic_cast<m::master_post_office*>(master.get())->get_udp_stats(); },
+                [master]() { return dynamic_cast<m::master_post_office*>(master.get())->get_tcp_connect_stats(); }};
             db->setAttribute(Qt::WA_DeleteOnClose);
             db->show();
             db->raise();
@@ -47,11 +47,9 @@ namespace fire
 
         namespace
         {
-            const double MIN_THREAD_SLEEP = 1; //in milliseconds 
-            const double MAX_THREAD_SLEEP = 51; //in milliseconds 
-            const double SLEEP_STEP = 5;
+            const auto RECEIVE_WAIT = std::chrono::milliseconds(50); //how often the in thread looks at _done
             const double QUIT_SLEEP = 500;
-            const size_t POOL_SIZE = 30; //small pool size for now
+            const size_t POOL_SIZE = 30; //most outgoing tcp connections open at once
         }
 
         metadata::encryption_type to_message_encryption_type(sc::encryption_type s)
@@ -67,27 +65,32 @@ namespace fire
             return r;
         }
 
+        n::endpoint_message::priority_class to_network_priority(metadata::priority_type p)
+        {
+            n::endpoint_message::priority_class r = n::endpoint_message::interactive;
+            switch(p)
+            {
+                case metadata::priority_type::realtime: r = n::endpoint_message::realtime; break;
+                case metadata::priority_type::interactive: r = n::endpoint_message::interactive; break;
+                case metadata::priority_type::bulk: r = n::endpoint_message::bulk; break;
+                default: CHECK(false && "missed case");
+            }
+            return r;
+        }
+
         void in_thread(master_post_office* o)
         try
         {
             REQUIRE(o);
             REQUIRE(o->_encrypted_channels);
 
-            double thread_sleep = MIN_THREAD_SLEEP;
-
             n::endpoint ep;
             while(!o->_done)
             try
             {
                 //get data from outside world
                 u::bytes data;
-                if(!o->_connections.receive(ep, data))
-                {
-                    u::sleep_thread(thread_sleep);
-                    thread_sleep = std::min(MAX_THREAD_SLEEP, thread_sleep + SLEEP_STEP);
-                    continue;
-                }
-                thread_sleep = MIN_THREAD_SLEEP;
+                if(!o->_connections.receive(ep, data, RECEIVE_WAIT)) continue;
 
                 if(o->_outside_stats.on) o->_outside_stats.in_push_count++;
 
@@ -196,27 +199,27 @@ namespace fire
                 const std::string outside_queue_address = m.meta.to.front();
                 last_address = outside_queue_address;
 
-                //encode, compress, and encrypt message
-                auto data = u::encode(m);
-                data = u::compress(data);
-
-                encrypt_message(
-                        data, 
-                        m, 
-                        outside_queue_address,
-                        *o->_encrypted_channels);
+                auto data = o->to_wire(m, outside_queue_address);
 
                 //send message over wire
-                o->_connections.send(outside_queue_address, data, m.meta.robust);
+                o->_connections.send(
+                        outside_queue_address, 
+                        data, 
+                        m.meta.robust, 
+                        m.meta.fec, 
+                        to_network_priority(m.meta.priority));
 
+                o->_out_pending--;
                 if(o->_outside_stats.on) o->_outside_stats.out_pop_count++;
             }
             catch(std::exception& e)
             {
+                o->_out_pending--;
                 LOG << "error sending message to " << last_address << ": " << e.what() << std::endl;
             }
             catch(...)
             {
+                o->_out_pending--;
                 LOG << "error sending message to " << last_address << ": unknown error." << std::endl;
             }
             u::sleep_thread(QUIT_SLEEP);
@@ -259,13 +262,53 @@ namespace fire
         bool master_post_office::send_outside(const message& m)
         {
             if(_outside_stats.on) _outside_stats.out_push_count++;
+            _out_pending++;
             _out.push(m);
             return true;
         }
 
-        const network::udp_stats& master_post_office::get_udp_stats() const
+        n::send_status master_post_office::try_send_outside(const message& m)
+        {
+            REQUIRE_GREATER_EQUAL(m.meta.from.size(), 1);
+            REQUIRE_GREATER_EQUAL(m.meta.to.size(), 1);
+
+            //messages already waiting on the out thread go first
+            if(_out_pending > 0) return n::send_status::would_block;
+
+            const auto& to = m.meta.to.front();
+            auto s = _connections.try_send(
+                    to, 
+                    to_wire(m, to),
+                    m.meta.robust, 
+                    m.meta.fec, 
+                    to_network_priority(m.meta.priority));
+
+            if(s == n::send_status::queued && _outside_stats.on) 
+            {
+                _outside_stats.out_push_count++;
+                _outside_stats.out_pop_count++;
+            }
+            return s;
+        }
+
+        u::bytes master_post_office::to_wire(const message& m, const std::string& to)
+        {
+            //encode, compress, and encrypt message
+            auto data = u::encode(m);
+            data = u::compress(data);
+
+            encrypt_message(data, m, to, *_encrypted_channels);
+            return data;
+        }
+
+        network::udp_stats master_post_office::get_udp_stats() const
         {
             return _connections.get_udp_stats();
         }
+
+        network::tcp_connect_stats master_post_office::get_tcp_connect_stats() const
+        {
+            return _connections.get_tcp_connect_stats();
+        }
     }
 }
@@ -38,6 +38,7 @@
 
 #include "util/thread.hpp"
 
+#include <atomic>
 #include <memory>
 #include <map>
 
@@ -55,10 +56,15 @@ namespace fire
                 virtual ~master_post_office();
 
             public:
-                const network::udp_stats& get_udp_stats() const;
+                network::udp_stats get_udp_stats() const;
+                network::tcp_connect_stats get_tcp_connect_stats() const;
 
             protected:
                 virtual bool send_outside(const message&);
+                virtual network::send_status try_send_outside(const message&);
+
+            private:
+                util::bytes to_wire(const message&, const std::string& to);
 
             private:
                 std::string _in_host;
@@ -66,6 +72,7 @@ namespace fire
                 util::thread_uptr _in_thread;
                 util::thread_uptr _out_thread;
                 queue _out;
+                std::atomic<size_t> _out_pending{0}; //pushed to _out and not sent yet
                 network::connection_manager _connections;
                 security::encrypted_channels_ptr _encrypted_channels;
 
@@ -56,6 +56,9 @@ namespace fire
             source_type source = source_type::local;
             encryption_type encryption = encryption_type::conversation;
             bool robust = true;
+            size_t fec = 0; //udp chunks per parity chunk, 0 is off
+            enum priority_type { realtime, interactive, bulk };
+            priority_type priority = priority_type::interactive;
         };
 
         struct message
@@ -141,8 +141,20 @@ namespace fire
 
         bool post_office::send(message m)
         {
+            return route(m, false) == network::send_status::queued;
+        }
+
+        network::send_status post_office::try_send(message m)
+        {
+            return route(m, true);
+        }
+
+        network::send_status post_office::route(message m, bool try_only)
+        {
+            using network::send_status;
+
             metadata& meta = m.meta;
-            if(meta.to.empty()) return false;
+            if(meta.to.empty()) return send_status::failed;
 
             if(meta.to.size() > 1 && meta.to.front() == _address)
                 meta.to.pop_front();
@@ -163,7 +175,8 @@ namespace fire
                             cp.meta.to.pop_front();
                             cp.meta.from.push_front(_address);
 
-                            if(sp->send(cp)) return true;
+                            auto s = sp->route(cp, try_only);
+                            if(s != send_status::failed) return s;
                         }
                     }
                 }
@@ -175,7 +188,9 @@ namespace fire
 
                 //send to parent.
                 //otherwise, try to send message to outside world
-                return _parent ? _parent->send(m) : send_outside(m);
+                if(_parent) return _parent->route(m, try_only);
+                if(try_only) return try_send_outside(m);
+                return send_outside(m) ? send_status::queued : send_status::failed;
             }
 
             //route to mailbox
@@ -191,13 +206,13 @@ namespace fire
                     if(auto sb = wb.lock())
                     {
                         sb->push_inbox(m);
-                        return true;
+                        return send_status::queued;
                     }
                 }
             }
 
             //could not send message
-            return false;
+            return send_status::failed;
         }
 
         void post_office::clean_mailboxes()
@@ -315,6 +330,12 @@ namespace fire
             return false;
         }
 
+        network::send_status post_office::try_send_outside(const message& m)
+        {
+            //subclasses that can tell a full connection override this
+            return send_outside(m) ? network::send_status::queued : network::send_status::failed;
+        }
+
         const mailbox_stats& post_office::outside_stats() const
         {
             return _outside_stats;
@@ -37,6 +37,7 @@
 #include <thread>
 
 #include "message/mailbox.hpp"
+#include "network/connection.hpp"
 #include "util/thread.hpp"
 
 namespace fire
@@ -64,6 +65,10 @@ namespace fire
             public:
                 bool send(message);
 
+                //like send, but a message for outside is not queued 
+                //when the connection it goes out on is full
+                network::send_status try_send(message);
+
             public:
                 bool add(mailbox_wptr);
                 bool has(mailbox_wptr) const;
@@ -91,7 +96,9 @@ namespace fire
                 void clean_mailboxes();
 
             protected:
+                network::send_status route(message, bool try_only);
                 virtual bool send_outside(const message&);
+                virtual network::send_status try_send_outside(const message&);
 
             protected:
 
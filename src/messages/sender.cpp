@@ -63,6 +63,28 @@ namespace fire
             return true;
         }
 
+        network::send_status sender::try_send(
+                const std::string& to, 
+                message::message m, 
+                message::post_office& post)
+        {
+            INVARIANT(_service);
+            INVARIANT(_mail);
+
+            auto contact = _service->user().contacts().by_id(to);
+            if(!contact) return network::send_status::failed;
+
+            //keep order with messages sent before that still wait in the outbox
+            if(_mail->out_size() > 0) return network::send_status::would_block;
+
+            const auto my_id = _service->user().info().id();
+            m.meta.to = {contact->address(), _mail->address()};
+            m.meta.from.push_front(_mail->address());
+            m.meta.extra["from_id"] = my_id;
+
+            return post.try_send(m);
+        }
+
         bool sender::send_to_local_app(const std::string& address, message::message m)
         {
             INVARIANT(_service);
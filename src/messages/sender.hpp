@@ -32,6 +32,7 @@
 #define FIRESTR_MESSAGES_SENDER_H
 
 #include "message/message.hpp"
+#include "message/post_office.hpp"
 #include "user/user_service.hpp"
 
 #include <string>
@@ -52,6 +53,14 @@ namespace fire
                  * @param to Id of user
                  */
                 bool send(const std::string& to, message::message);
+
+                /**
+                 * Send a message to the recipient through the post office
+                 * the mailbox is in, without queuing it when the connection is full
+                 * @param to Id of user
+                 * @param post Post office the mailbox was added to
+                 */
+                network::send_status try_send(const std::string& to, message::message, message::post_office& post);
                 bool send_to_local_app(const std::string& address, message::message);
 
             public:
@@ -78,6 +78,11 @@ namespace fire
             p.block = get_opt(o, "block", 0);
             p.wait = get_opt(o, "wait", 0);
             p.track_incoming = get_opt(o, "track_incoming", 0);
+            p.shards = get_opt(o, "shards", 1);
+            p.upload_rate = get_opt(o, "upload_rate", 0);
+            p.reassembly_budget = get_opt(o, "reassembly_budget", p.reassembly_budget);
+            p.uring = get_opt(o, "uring", 0);
+            p.no_delay = get_opt(o, "no_delay", 1);
 
             return p;
         }
@@ -109,5 +114,64 @@ namespace fire
             return s.str();
         }
 
+        send_budget::send_budget(size_t limit) : _limit{limit}
+        {
+            REQUIRE_GREATER(limit, 0);
+        }
+
+        bool send_budget::has_room(size_t bytes) const
+        {
+            return _used == 0 || _used + bytes <= _limit;
+        }
+
+        bool send_budget::try_take(size_t bytes)
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            if(!has_room(bytes)) return false;
+
+            _used += bytes;
+            return true;
+        }
+
+        void send_budget::take(size_t bytes, bool wait)
+        {
+            std::unique_lock<std::mutex> l(_mutex);
+
+            //a closed connection will not drain, so nobody waits on it
+            if(wait) _drained.wait(l, [&]{ return _closed || has_room(bytes);});
+            _used += bytes;
+        }
+
+        void send_budget::give_back(size_t bytes)
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                CHECK_GREATER_EQUAL(_used, bytes);
+                _used -= std::min(_used, bytes);
+            }
+            _drained.notify_all();
+        }
+
+        void send_budget::close()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _closed = true;
+            }
+            _drained.notify_all();
+        }
+
+        void send_budget::open()
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            _closed = false;
+        }
+
+        size_t send_budget::used() const
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _used;
+        }
+
     }
 }
@@ -36,6 +36,9 @@
 #include "network/message_queue.hpp"
 #include "util/thread.hpp"
 
+#include <condition_variable>
+#include <mutex>
+
 namespace fire
 {
     namespace network
@@ -55,12 +58,48 @@ namespace fire
             bool block;
             double wait;
             bool track_incoming;
+            size_t shards = 1; //udp sockets sharing the port, each on its own thread
+            size_t upload_rate = 0; //udp bytes per second across all shards, 0 is no cap
+            size_t reassembly_budget = 64 * 1024 * 1024; //bytes of partial udp messages across all shards
+            bool uring = false; //udp io through io_uring where the kernel has it, opt in with uring=1
+            bool no_delay = true; //tcp sends without waiting to fill a segment
+        };
+
+        enum class send_status { queued, would_block, failed };
+
+        //bytes handed to a connection but not written out yet. blocking senders 
+        //wait for it to drain, try_send callers are told to come back later.
+        //a message larger than the limit still goes when nothing else is queued
+        class send_budget
+        {
+            public:
+                send_budget(size_t limit);
+
+            public:
+                bool try_take(size_t bytes);
+                void take(size_t bytes, bool wait);
+                void give_back(size_t bytes);
+                void close();
+                void open();
+                size_t used() const;
+
+            private:
+                bool has_room(size_t bytes) const;
+
+            private:
+                size_t _limit;
+                size_t _used = 0;
+                bool _closed = false;
+                mutable std::mutex _mutex;
+                std::condition_variable _drained;
         };
 
         class connection
         {
             public:
             virtual bool send(const fire::util::bytes& b, bool block = false) = 0;
+            virtual send_status try_send(const fire::util::bytes& b) = 0;
+            virtual bool send_stream(const fire::util::bytes& frame) = 0;
             virtual endpoint get_endpoint() const = 0;
             virtual bool is_disconnected() const = 0;
         };
@@ -34,7 +34,9 @@
 #include "util/dbc.hpp"
 #include "util/log.hpp"
 
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
 
 namespace u = fire::util;
 
@@ -42,31 +44,78 @@ namespace fire
 {
     namespace network
     {
-        void tcp_send_thread(connection_manager*);
+        namespace
+        {
+            const size_t TCP_SEND_WORKERS = 4; //a connect to a slow peer ties up one
+            const size_t TCP_SEND_BATCH = 32; //messages sent to a peer before the next one gets a turn
+            const size_t TCP_SERVICE_THREADS = 2; //run the io of the whole tcp pool
+            const auto TCP_POOL_SWEEP = std::chrono::seconds(1); //how often idle connections are looked for
+            const auto TCP_SEND_RETRY = std::chrono::milliseconds(5); //before a peer with a full connection gets another turn
+
+            template <class connection>
+                send_status send_item_on(connection& c, const send_item& i)
+                {
+                    if(!i.stream) return c.try_send(i.data);
+                    return c.send_stream(i.data) ? send_status::queued : send_status::failed;
+                }
+        }
 
-        connection_manager::connection_manager(size_t size, port_type local_port, bool tcp_listen) :
-            _rstate{receive_state::IN_UDP1},
-            _pool(size),
+        void tcp_send_worker(connection_manager*);
+
+        connection_manager::connection_manager(
+                size_t size, 
+                port_type local_port, 
+                bool tcp_listen, 
+                size_t udp_shards,
+                size_t udp_upload_rate,
+                const inbound_weights& weights,
+                const tcp_send_limits& tcp_limits,
+                const tcp_pool_limits& pool_limits) :
+            _inbound{weights},
+            _tcp_service{std::make_shared<tcp_service>(TCP_SERVICE_THREADS)},
+            _pool_max{size},
+            _pool_limits{pool_limits},
+            _pool_service{std::make_shared<tcp_service>()},
+            _pool_io(_pool_service->next()),
+            _pool_timer{_pool_io},
             _local_port{local_port},
+            _udp_shards{udp_shards},
+            _udp_upload_rate{udp_upload_rate},
             _tcp_listen{tcp_listen},
-            _done{false}
+            _done{false},
+            _tcp_limits{tcp_limits},
+            _streams{[this](const std::string& to, const u::bytes& f) { return send_stream_frame(to, f); }}
         {
-            teardown_and_repool_tcp_connections();
+            REQUIRE_GREATER(size, 0);
+
+            if(_tcp_listen) create_tcp_endpoint();
             create_udp_endpoint();
+            schedule_pool_sweep();
 
-            _tcp_send_thread.reset(new std::thread{tcp_send_thread, this});
+            for(size_t i = 0; i < TCP_SEND_WORKERS; i++)
+                _tcp_send_workers.emplace_back(new std::thread{tcp_send_worker, this});
 
-            ENSURE_FALSE(_pool.empty());
             ENSURE(!_tcp_listen || _in);
             ENSURE(_udp_con);
-            ENSURE(_tcp_send_thread);
+            ENSURE_EQUAL(_tcp_send_workers.size(), TCP_SEND_WORKERS);
         }
 
         connection_manager::~connection_manager()
         {
             _done = true;
-            _tcp_send_queue.done();
-            if(_tcp_send_thread) _tcp_send_thread->join();
+            _inbound.done();
+            _streams.close();
+            _tcp_ready.done();
+            for(auto& t : _tcp_send_workers) t->join();
+
+            //the sweep runs on the timer's thread, so it is stopped there.
+            //the second pass lets a sweep that was already due see _pool_closed
+            run_on_io(_pool_io, [this]
+            {
+                _pool_closed = true;
+                _pool_timer.cancel();
+            });
+            run_on_io(_pool_io, []{});
         }
 
         void connection_manager::create_udp_endpoint()
@@ -82,8 +131,14 @@ namespace fire
                 false, //block;
                 0, // wait;
                 true, //track_incoming;
+                _udp_shards,
+                _udp_upload_rate
             };
-            _udp_con = create_udp_queue(udp_p);
+            _udp_con = create_udp_queue(udp_p, [this](endpoint_message& em)
+            {
+                inbound_message m{inbound_message::udp, em.ep, std::move(em.data), em.stream};
+                _inbound.push(m);
+            });
         }
         void connection_manager::create_tcp_endpoint()
         {
@@ -97,20 +152,21 @@ namespace fire
                 {"block", "0"},
                 {"track_incoming", "1"}};
 
-            _in = create_tcp_queue(listen_address, qo);
+            _in = create_tcp_queue(listen_address, qo, _tcp_service, tcp_receiver(true));
             ENSURE(_in);
         }
 
         asio_params connection_manager::create_tcp_params()
         {
-            //create outgoing params
+            //create outgoing params. queues are made on demand, after the listener
+            //has the local port, so with one they take any port
             asio_params p = {
                 asio_params::tcp, 
                 asio_params::delayed_connect, 
                 "", //uri
                 "", //host
                 0, //port
-                _local_port,
+                _tcp_listen ? port_type(0) : _local_port,
                 false, //block;
                 0, // wait;
                 false, //track_incoming;
@@ -118,126 +174,126 @@ namespace fire
             return p;
         }
 
-        void connection_manager::create_tcp_pool()
+        void connection_manager::close_pooled(tcp_connection_pool::iterator p, tcp_queues& closed)
         {
-            auto par = create_tcp_params(); 
-            for(auto& p : _pool) p = std::make_shared<tcp_queue>(par);
-        }
+            REQUIRE(p != _pool.end());
+            CHECK(p->queue);
 
-        void connection_manager::cleanup_pool()
-        {
-            //clean up disconnected connections
-            for(auto& p : _pool)
-                if(p && p->is_disconnected()) 
-                    p.reset();
+            //it is closing, so it is not connecting anymore
+            auto s = p->queue->connect_stats();
+            s.connecting = 0;
+            _closed_tcp_stats += s;
 
-            auto i = _out.begin();
-            while(i != _out.end())
-            {
-                CHECK_RANGE(i->second, 0, _pool.size());
-                auto& p = _pool[i->second];
-                if(!p) i = _out.erase(i);
-                else i++;
-            }
+            closed.push_back(p->queue);
+            _out.erase(p->address);
+            _pool.erase(p);
+
+            ENSURE_EQUAL(_pool.size(), _out.size());
         }
 
-        void connection_manager::teardown_and_repool_tcp_connections()
+        void connection_manager::schedule_pool_sweep()
         {
-            LOG << "creating listening tcp connection and outgoing pool..." << std::endl;
-            _in.reset();
-            _in_connections.clear();
-
-            cleanup_pool();
-
-            if(_tcp_listen)
-            {
-#ifdef __APPLE__
-                create_tcp_endpoint();
-#endif
-                create_tcp_pool();
-
-#ifndef __APPLE__
-                create_tcp_endpoint();
-#endif
-            }
+            _pool_timer.expires_after(TCP_POOL_SWEEP);
+            _pool_timer.async_wait(
+                    boost::bind(&connection_manager::sweep_pool, this,
+                        boost::asio::placeholders::error));
         }
 
-        tcp_queue_ptr connection_manager::get_connected_queue(const std::string& address)
+        void connection_manager::sweep_pool(const boost::system::error_code& error)
         {
-            auto p = _out.find(address);
-            if(p != _out.end()) 
+            if(error || _pool_closed) return;
+
+            tcp_queues closed;
             {
-                auto& c = _pool[p->second];
-                CHECK(c);
-                if(!c->is_disconnected()) 
-                    return c;
+                u::mutex_scoped_lock l(_mutex);
+                const auto now = std::chrono::steady_clock::now();
+
+                //connections that went down and were not tried again since the last sweep
+                auto p = _pool.begin();
+                while(p != _pool.end())
+                {
+                    auto c = p++;
+                    if(c->queue->is_disconnected() && now - c->used >= TCP_POOL_SWEEP) 
+                        close_pooled(c, closed);
+                }
+
+                //the front has been idle the longest
+                while(_pool.size() > _pool_limits.min && now - _pool.front().used >= _pool_limits.idle_timeout)
+                    close_pooled(_pool.begin(), closed);
             }
 
-            return tcp_queue_ptr{};
+            if(!closed.empty()) 
+                LOG << "closing " << closed.size() << " idle or dropped tcp connections..." << std::endl;
+
+            //closing waits on the io threads, so it is done outside the lock
+            closed.clear();
+            schedule_pool_sweep();
         }
 
-        size_t connection_manager::find_next_available()
+        tcp_queue_ptr connection_manager::get_connected_queue(const std::string& address)
         {
-            size_t next_available = 0;
-            for(;next_available < _pool.size(); next_available++)
-            {
-                auto &p = _pool[next_available];
-                //skip connected connections
-                if(p) continue;
+            auto p = _out.find(address);
+            if(p == _out.end()) return tcp_queue_ptr{};
 
-                auto par = create_tcp_params(); 
-                p = std::make_shared<tcp_queue>(par);
-                break;
-            }
+            auto c = p->second;
+            CHECK(c->queue);
+            if(c->queue->is_disconnected()) return tcp_queue_ptr{};
 
-            ENSURE(next_available == _pool.size() || _pool[next_available]);
-            return next_available;
+            //move to the back as the most recently used
+            c->used = std::chrono::steady_clock::now();
+            _pool.splice(_pool.end(), _pool, c);
+            return c->queue;
         }
 
         tcp_queue_ptr connection_manager::connect(const std::string& address)
         try
         {
-            auto next_available = _pool.size();
+            //parse address to host, port
+            auto a = parse_address(address);
+
+            //the queue is picked and added at once, since the send 
+            //workers may be connecting to other peers at the same time.
+            //closed goes before the lock so the queues are closed after unlocking
+            tcp_queues closed;
+            tcp_queue_ptr q;
             {
                 u::mutex_scoped_lock l(_mutex);
-                auto q = get_connected_queue(address);
+                q = get_connected_queue(address);
                 if(q) return q;
-                next_available = find_next_available();
-            }
 
+                //a connection that went down is replaced
+                auto p = _out.find(address);
+                if(p != _out.end()) close_pooled(p->second, closed);
 
-            //If we ran out of connections in the out pool then we tear down our tcp connections
-            //and repool. Obviously this algorithm won't work well if we have as many greeters
-            //as the pool size. Still figuring this out.
-            if(next_available >= _pool.size()) 
-            {
-                u::mutex_scoped_lock l(_mutex);
-                LOG << "ran out of outgoing tcp connections..." << std::endl;
-                teardown_and_repool_tcp_connections();
-                next_available = find_next_available();
-                if(next_available >= _pool.size()) 
+                //make room by closing the connection used least recently that has
+                //nothing left to write. when all of them do, the oldest goes anyway
+                if(_pool.size() >= _pool_max)
                 {
-                    LOG << "unable to get tcp connection from the pool..." << std::endl;
-                    return tcp_queue_ptr{};
+                    auto v = std::find_if(_pool.begin(), _pool.end(), 
+                            [](const pooled_tcp_queue& c) { return c.queue->queued_bytes() == 0;});
+                    if(v == _pool.end()) v = _pool.begin();
+
+                    const auto unsent = v->queue->queued_bytes();
+                    LOG << "tcp pool full, closing connection to `" << v->address << "'..." << std::endl;
+                    if(unsent > 0) LOG << "dropping " << unsent << " unsent bytes to `" << v->address << "'" << std::endl;
+                    close_pooled(v, closed);
                 }
-            }
-
-            CHECK_RANGE(next_available, 0, _pool.size());
-            CHECK(_pool[next_available]);
-            CHECK(_pool[next_available]->is_disconnected());
 
-            //parse address to host, port
-            auto a = parse_address(address);
+                auto par = create_tcp_params(); 
+                q = std::make_shared<tcp_queue>(par, _tcp_service, tcp_receiver(false));
+                _pool.push_back({address, q, std::chrono::steady_clock::now()});
+                _out[address] = std::prev(_pool.end());
 
-            //assign address to socket and connect
-            {
-                u::mutex_scoped_lock l(_mutex);
-                _out[address] = next_available;
+                CHECK_EQUAL(_pool.size(), _out.size());
+                CHECK_RANGE(_pool.size(), 1, _pool_max + 1);
             }
-            _pool[next_available]->connect(a.host, a.port);
+            closed.clear();
+
+            //resolving the host can take a while, so connect outside the lock
+            q->connect(a.host, a.port);
 
-            ENSURE_BETWEEN(next_available, 0, _pool.size());
-            return _pool[next_available];
+            ENSURE(q);
+            return q;
         }
         catch(std::exception& e)
         {
@@ -250,28 +306,42 @@ namespace fire
             return tcp_queue_ptr{};
         }
 
-        bool connection_manager::send(const std::string& to, const u::bytes& b, bool robust)
+        endpoint_message make_udp_message(
+                const std::string& to, 
+                const u::bytes& b, 
+                bool robust, 
+                size_t fec, 
+                endpoint_message::priority_class priority)
+        {
+            auto a = parse_address(to);
+            endpoint ep { UDP, a.host, a.port};
+            return endpoint_message{ep, b, robust, fec, priority}; 
+        }
+
+        bool connection_manager::send(
+                const std::string& to, 
+                const u::bytes& b, 
+                bool robust, 
+                size_t fec, 
+                endpoint_message::priority_class priority)
         try
         {
             INVARIANT(_udp_con);
 
             auto type = determine_type(to);
 
-            //if tcp, then push it to the tcp send queue
-            //which is processed by another thread so that
+            //if tcp, then push it to the destination's queue
+            //which is sent by the tcp send workers so that
             //udp connections are not blocked by tcp
             if(type == asio_params::tcp)
             {
-                _tcp_send_queue.push({to, b});
-                return true;
+                send_item i{to, b};
+                return queue_tcp(i) == send_status::queued;
             } else if (type != asio_params::udp) return false;
 
             CHECK(type == asio_params::udp);
 
-            auto a = parse_address(to);
-            endpoint ep { UDP, a.host, a.port};
-            endpoint_message em{ep, b, robust}; 
-            return _udp_con->send(em);
+            return _udp_con->send(make_udp_message(to, b, robust, fec, priority));
         }
         catch(std::exception& e)
         {
@@ -284,106 +354,132 @@ namespace fire
             return false;
         }
 
-        void connection_manager::transition_udp_state()
+        send_status connection_manager::try_send(
+                const std::string& to, 
+                const u::bytes& b, 
+                bool robust, 
+                size_t fec, 
+                endpoint_message::priority_class priority)
+        try
         {
-            REQUIRE(_rstate != IN_TCP);
-            REQUIRE(_rstate != OUT_TCP);
+            INVARIANT(_udp_con);
+
+            auto type = determine_type(to);
 
-            auto ps = _rstate; 
-            switch(_rstate)
+            //tcp messages wait in the destination's queue, so that is what fills up
+            if(type == asio_params::tcp)
             {
-                case receive_state::IN_UDP1: _rstate = receive_state::IN_UDP2; break;
-                case receive_state::IN_UDP2: _rstate = receive_state::IN_UDP3; break;
-                case receive_state::IN_UDP3: _rstate = receive_state::IN_UDP4; break;
-                case receive_state::IN_UDP4: _rstate = receive_state::IN_UDP5; break;
-                case receive_state::IN_UDP5: _rstate = receive_state::IN_UDP6; break;
-                case receive_state::IN_UDP6: _rstate = receive_state::IN_UDP7; break;
-                case receive_state::IN_UDP7: _rstate = receive_state::IN_UDP8; break;
-                case receive_state::IN_UDP8: 
-                                             _rstate = _tcp_listen ? receive_state::IN_TCP : receive_state::OUT_TCP;
-                                             break;
-                default: CHECK(false && "missed case");
-            }
+                send_item i{to, b};
+                return queue_tcp(i);
+            } else if (type != asio_params::udp) return send_status::failed;
+
+            CHECK(type == asio_params::udp);
+
+            return _udp_con->try_send(make_udp_message(to, b, robust, fec, priority));
+        }
+        catch(std::exception& e)
+        {
+            LOG << "error sending message to `" << to << "' (" << b.size() << " bytes). " << e.what() << std::endl; 
+            return send_status::failed;
+        }
+        catch(...)
+        {
+            LOG << "unknown error sending message to `" << to << "' (" << b.size() << " bytes)." << std::endl; 
+            return send_status::failed;
+        }
+
+        send_status connection_manager::send_stream(
+                const std::string& to, 
+                stream_id id, 
+                const u::bytes& data, 
+                bool end, 
+                bool block)
+        try
+        {
+            return _streams.send(to, id, data, end, block);
+        }
+        catch(std::exception& e)
+        {
+            LOG << "error sending stream " << id << " to `" << to << "' (" << data.size() << " bytes). " << e.what() << std::endl; 
+            return send_status::failed;
+        }
+        catch(...)
+        {
+            LOG << "unknown error sending stream " << id << " to `" << to << "' (" << data.size() << " bytes)." << std::endl; 
+            return send_status::failed;
+        }
+
+        bool connection_manager::receive_stream(stream_segment& s)
+        {
+            return _streams.receive(s);
+        }
+
+        bool connection_manager::send_stream_frame(const std::string& to, const u::bytes& frame)
+        try
+        {
+            INVARIANT(_udp_con);
+
+            auto type = determine_type(to);
+            if(type == asio_params::tcp)
+            {
+                send_item i{to, frame, true};
+                return queue_tcp(i) == send_status::queued;
+            } else if (type != asio_params::udp) return false;
+
+            CHECK(type == asio_params::udp);
+
+            //streams are for moving a lot of data, so they get what is left of the upload
+            auto em = make_udp_message(to, frame, true, 0, endpoint_message::bulk);
+            em.stream = true;
+            return _udp_con->send(em);
+        }
+        catch(std::exception& e)
+        {
+            LOG << "error sending stream frame to `" << to << "' (" << frame.size() << " bytes). " << e.what() << std::endl; 
+            return false;
+        }
+        catch(...)
+        {
+            LOG << "unknown error sending stream frame to `" << to << "' (" << frame.size() << " bytes)." << std::endl; 
+            return false;
+        }
 
-            ENSURE(ps != receive_state::IN_UDP8 || _rstate == receive_state::IN_TCP || _rstate == receive_state::OUT_TCP) 
-            ENSURE(_rstate != ps);
+        tcp_receive_handler connection_manager::tcp_receiver(bool incoming)
+        {
+            return [this, incoming](tcp_connection* c, u::bytes& b, bool stream)
+            {
+                CHECK(c);
+                inbound_message m{inbound_message::tcp, c->get_endpoint(), std::move(b), stream};
+                if(incoming) m.from = c;
+                _inbound.push(m);
+            };
         }
 
-        bool connection_manager::receive(endpoint& ep, u::bytes& b)
+        bool connection_manager::receive(endpoint& ep, u::bytes& b, std::chrono::milliseconds wait)
         {
-            //if we quite in prior call and got to done state
-            //or returned with a message in OUT_TCP case, we
-            //reset to IN_UPD and start over
-            if(_rstate == receive_state::DONE) 
-                _rstate = receive_state::IN_UDP1;
+            const auto until = inbound_queue::clock::now() + wait;
 
-            while(_rstate != receive_state::DONE)
+            inbound_message m;
+            while(_inbound.pop(m, until))
             {
-                switch(_rstate)
+                //answer over the connection a message came in on
+                if(m.from)
+                {
+                    u::mutex_scoped_lock l(_mutex);
+                    _in_connections[make_address_str(m.ep)] = m.from;
+                }
+
+                if(m.stream) 
                 {
-                    case receive_state::IN_UDP1:
-                    case receive_state::IN_UDP2:
-                    case receive_state::IN_UDP3:
-                    case receive_state::IN_UDP4:
-                    case receive_state::IN_UDP5:
-                    case receive_state::IN_UDP6:
-                    case receive_state::IN_UDP7:
-                    case receive_state::IN_UDP8:
-                        {
-                            endpoint_message um;
-                            transition_udp_state();
-                            if(_udp_con->receive(um))
-                            {
-
-                                ep = um.ep;
-                                b = std::move(um.data);
-                                return true;
-                            }
-                        }
-                        break;
-
-                    case receive_state::IN_TCP:
-                        {
-                            _rstate = receive_state::OUT_TCP;
-                            u::mutex_scoped_lock l(_mutex);
-                            INVARIANT(_in);
-                            if(_in->receive(b)) 
-                            {
-                                auto s = _in->get_socket();
-                                CHECK(s);
-                                ep = s->get_endpoint();
-                                _in_connections[make_address_str(ep)] = s;
-                                return true;
-                            }
-                        }
-                        break;
-
-                    case receive_state::OUT_TCP:
-                        {
-                            _rstate = receive_state::DONE;
-                            u::mutex_scoped_lock l(_mutex);
-                            for(auto p : _out)
-                            {
-                                auto i = p.second;
-                                CHECK_RANGE(i, 0, _pool.size());
-
-                                auto c = _pool[i];
-                                CHECK(c);
-                                if(c->receive(b)) 
-                                {
-                                    auto s = c->get_socket();
-                                    CHECK(s);
-                                    ep = s->get_endpoint();
-                                    return true;
-                                }
-                            }
-                        }
-                        break;
-                    default: CHECK(false && "missed case");
+                    _streams.received(m.ep, m.data);
+                    continue;
                 }
+
+                ep = m.ep;
+                b = std::move(m.data);
+                return true;
             }
 
-            ENSURE(_rstate == receive_state::DONE);
             return false;
         }
 
@@ -396,42 +492,172 @@ namespace fire
             return si->second->is_disconnected();
         }
 
-        const udp_stats& connection_manager::get_udp_stats() const
+        void connection_manager::on_udp_prefix(prefix_handler h)
+        {
+            INVARIANT(_udp_con);
+            _udp_con->on_prefix(h);
+        }
+
+        udp_stats connection_manager::get_udp_stats() const
         {
             INVARIANT(_udp_con);
             return _udp_con->stats();
         }
 
-        void tcp_send_thread(connection_manager* m)
+        tcp_connect_stats connection_manager::get_tcp_connect_stats() const
         {
-            REQUIRE(m);
-            while(!m->_done)
-            try
+            u::mutex_scoped_lock l(_mutex);
+            auto s = _closed_tcp_stats;
+            for(const auto& p : _pool) s += p.queue->connect_stats();
+            return s;
+        }
+
+        peer_windows connection_manager::get_udp_windows() const
+        {
+            INVARIANT(_udp_con);
+            return _udp_con->windows();
+        }
+
+        send_status connection_manager::queue_tcp(send_item& i)
+        {
+            u::mutex_scoped_lock l(_tcp_send_mutex);
+
+            auto& d = _tcp_destinations[i.to];
+            if(!d) d = std::make_shared<tcp_destination>(_tcp_limits.queue_bytes);
+
+            //streams have their own flow control, so they are never turned away
+            const auto size = i.data.size();
+            bool room = i.stream || d->budget.try_take(size);
+            if(i.stream) d->budget.take(size, false);
+
+            if(!room && _tcp_limits.when_full == tcp_send_limits::drop)
+            {
+                size_t dropped = 0;
+                auto m = d->queue.begin(); 
+                while(!room && m != d->queue.end())
+                {
+                    if(m->stream) { m++; continue;}
+
+                    d->budget.give_back(m->data.size());
+                    m = d->queue.erase(m);
+                    dropped++;
+                    room = d->budget.try_take(size);
+                }
+                if(dropped) LOG << "dropped " << dropped << " old tcp messages to `" << i.to << "'" << std::endl;
+            }
+
+            if(!room) return send_status::would_block;
+
+            d->queue.emplace_back(std::move(i));
+            if(!d->scheduled)
+            {
+                d->scheduled = true;
+                _tcp_ready.push(d->queue.back().to);
+            }
+            return send_status::queued;
+        }
+
+        void connection_manager::send_queued_tcp(const std::string& to)
+        {
+            tcp_destination_ptr d;
+            {
+                u::mutex_scoped_lock l(_tcp_send_mutex);
+                auto p = _tcp_destinations.find(to);
+                if(p == _tcp_destinations.end()) return;
+                d = p->second;
+            }
+            CHECK(d);
+            CHECK(d->scheduled);
+
+            bool blocked = false;
+            for(size_t n = 0; n < TCP_SEND_BATCH && !_done; n++)
             {
                 send_item i;
-                if(!m->_tcp_send_queue.pop(i, true))
-                    continue;
+                {
+                    u::mutex_scoped_lock l(_tcp_send_mutex);
+                    if(d->queue.empty()) break;
+
+                    i = std::move(d->queue.front());
+                    d->queue.pop_front();
+                }
+
+                //a bad message must not keep the rest of the queue from going out
+                auto s = send_status::failed;
+                try { s = send_tcp(i); }
+                catch(std::exception& e)
+                {
+                    LOG << "connection_manager: error sending tcp message to `" << to << "'. " << e.what() << std::endl;
+                }
 
-                //first check in tcp_connections for matching address and use that to send
-                //otherwise use outgoing tcp_connection.
+                u::mutex_scoped_lock l(_tcp_send_mutex);
+
+                //the connection is full, so the message waits here and still counts 
+                //against the destination. senders see the backpressure or drops from it
+                if(s == send_status::would_block)
                 {
-                    u::mutex_scoped_lock l(m->_mutex);
-
-                    auto inp = m->_in_connections.find(i.to);
-                    if(inp != m->_in_connections.end())
-                    {
-                        auto o = inp->second;
-                        CHECK(o);
-                        if(!o->is_disconnected()) 
-                        {
-                            o->send(i.data);
-                            continue;
-                        }
-                    }
+                    d->queue.emplace_front(std::move(i));
+                    blocked = true;
+                    break;
                 }
 
-                auto o = m->connect(i.to);
-                if(o) o->send(i.data);
+                //the connection queues the message from here on
+                d->budget.give_back(i.data.size());
+            }
+
+            u::mutex_scoped_lock l(_tcp_send_mutex);
+            if(d->queue.empty())
+            {
+                d->scheduled = false;
+                _tcp_destinations.erase(to);
+            }
+            //go to the back of the line if there is more, so other peers get a turn
+            else if(!blocked) _tcp_ready.push(to);
+            else retry_tcp_later(to);
+        }
+
+        void connection_manager::retry_tcp_later(const std::string& to)
+        {
+            auto t = std::make_shared<boost::asio::steady_timer>(_pool_io, TCP_SEND_RETRY);
+            t->async_wait([this, t, to](const boost::system::error_code& error)
+            {
+                if(error || _pool_closed) return;
+                _tcp_ready.push(to);
+            });
+        }
+
+        send_status connection_manager::send_tcp(send_item& i)
+        {
+            //first check in tcp_connections for matching address and use that to send
+            //otherwise use outgoing tcp_connection.
+            {
+                u::mutex_scoped_lock l(_mutex);
+
+                auto inp = _in_connections.find(i.to);
+                if(inp != _in_connections.end())
+                {
+                    auto o = inp->second;
+                    CHECK(o);
+                    if(!o->is_disconnected()) return send_item_on(*o, i);
+                }
+            }
+
+            auto o = connect(i.to);
+            if(!o) return send_status::failed;
+
+            return send_item_on(*o, i);
+        }
+
+        void tcp_send_worker(connection_manager* m)
+        {
+            REQUIRE(m);
+            while(!m->_done)
+            try
+            {
+                std::string to;
+                if(!m->_tcp_ready.pop(to, true))
+                    continue;
+
+                m->send_queued_tcp(to);
             }
             catch(std::exception& e)
             {
@@ -31,10 +31,15 @@
 #ifndef FIRESTR_NETWORK_CONNECTION_MANAGER_H
 #define FIRESTR_NETWORK_CONNECTION_MANAGER_H
 
+#include "network/inbound_queue.hpp"
+#include "network/stream.hpp"
 #include "network/tcp_queue.hpp"
 #include "network/udp_queue.hpp"
 #include "util/thread.hpp"
 
+#include <chrono>
+#include <deque>
+#include <list>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -43,74 +48,161 @@ namespace fire
 {
     namespace network 
     {
-        using assignment_map = std::unordered_map<std::string, size_t>; 
-        using tcp_connection_pool = std::vector<tcp_queue_ptr>;
         using connection_map = std::unordered_map<std::string, connection*>; 
 
+        //an outgoing tcp queue and the peer it is connected to
+        struct pooled_tcp_queue
+        {
+            std::string address;
+            tcp_queue_ptr queue;
+            std::chrono::steady_clock::time_point used;
+        };
+
+        //least recently used at the front
+        using tcp_connection_pool = std::list<pooled_tcp_queue>;
+        using tcp_pool_index = std::unordered_map<std::string, tcp_connection_pool::iterator>;
+        using tcp_queues = std::vector<tcp_queue_ptr>;
+
+        //the outgoing pool grows as peers are connected to, up to the size given 
+        //to the connection_manager. past that the least recently used connection 
+        //is closed to make room, and connections idle too long are closed down to min
+        struct tcp_pool_limits
+        {
+            size_t min = 4; //left open however long they sit idle
+            std::chrono::seconds idle_timeout{300};
+        };
+
         struct send_item
         {
             std::string to;
             util::bytes data;
+            bool stream = false;
+        };
+
+        //how much may wait to go out to one tcp peer, and what a send does past that
+        struct tcp_send_limits
+        {
+            enum overflow { backpressure, drop };
+
+            size_t queue_bytes = 4 * 1024 * 1024;
+
+            //backpressure turns the new message away. drop makes room by throwing 
+            //away the oldest messages waiting. stream frames are never dropped
+            overflow when_full = backpressure;
         };
-        using send_queue = util::queue<send_item>;
+
+        //tcp messages waiting for one peer. one worker at a time sends them, 
+        //so they keep their order and a slow peer holds up only itself
+        struct tcp_destination
+        {
+            tcp_destination(size_t limit) : budget{limit} {}
+
+            std::deque<send_item> queue;
+            send_budget budget; //bytes in queue, and in the message a worker is handing over
+            bool scheduled = false; //waiting for a worker or with one
+        };
+        using tcp_destination_ptr = std::shared_ptr<tcp_destination>;
+        using tcp_destinations = std::unordered_map<std::string, tcp_destination_ptr>;
+        using tcp_destination_queue = util::queue<std::string>;
 
         class connection_manager
         {
             public:
-                connection_manager(size_t size, port_type listen_port, bool tcp_listen = true);
+                connection_manager(
+                        size_t size, 
+                        port_type listen_port, 
+                        bool tcp_listen = true, 
+                        size_t udp_shards = 1,
+                        size_t udp_upload_rate = 0,
+                        const inbound_weights& weights = {},
+                        const tcp_send_limits& tcp_limits = {},
+                        const tcp_pool_limits& pool_limits = {});
                 ~connection_manager();
 
             public:
-                bool receive(endpoint& ep, util::bytes& b);
-                bool send(const std::string& to, const util::bytes& b, bool robust = true);
+                //waits up to `wait' for a message from any transport
+                bool receive(
+                        endpoint& ep, 
+                        util::bytes& b, 
+                        std::chrono::milliseconds wait = std::chrono::milliseconds{0});
+                bool send(
+                        const std::string& to, 
+                        const util::bytes& b, 
+                        bool robust = true, 
+                        size_t fec = 0, 
+                        endpoint_message::priority_class priority = endpoint_message::interactive);
+                send_status try_send(
+                        const std::string& to, 
+                        const util::bytes& b, 
+                        bool robust = true, 
+                        size_t fec = 0, 
+                        endpoint_message::priority_class priority = endpoint_message::interactive);
+                send_status send_stream(
+                        const std::string& to, 
+                        stream_id id, 
+                        const util::bytes& data, 
+                        bool end = false, 
+                        bool block = false);
+                bool receive_stream(stream_segment& s);
                 bool is_disconnected(const std::string& addr);
-                const udp_stats& get_udp_stats() const;
+                void on_udp_prefix(prefix_handler);
+                udp_stats get_udp_stats() const;
+                tcp_connect_stats get_tcp_connect_stats() const;
+                peer_windows get_udp_windows() const;
 
             private:
                 tcp_queue_ptr get_connected_queue(const std::string& address);
                 tcp_queue_ptr connect(const std::string& address);
-                void teardown_and_repool_tcp_connections();
+                void close_pooled(tcp_connection_pool::iterator p, tcp_queues& closed);
                 void create_udp_endpoint();
                 void create_tcp_endpoint();
-                void create_tcp_pool();
-                void cleanup_pool();
-                size_t find_next_available();
+                void schedule_pool_sweep();
+                void sweep_pool(const boost::system::error_code& error);
                 asio_params create_tcp_params();
+                bool send_stream_frame(const std::string& to, const util::bytes& frame);
+                tcp_receive_handler tcp_receiver(bool incoming);
+                send_status queue_tcp(send_item& i);
+                void send_queued_tcp(const std::string& to);
+                void retry_tcp_later(const std::string& to);
+                send_status send_tcp(send_item& i);
 
-            private:
-                enum receive_state { 
-                    IN_UDP1, 
-                    IN_UDP2, 
-                    IN_UDP3, 
-                    IN_UDP4, 
-                    IN_UDP5, 
-                    IN_UDP6, 
-                    IN_UDP7, 
-                    IN_UDP8, 
-                    IN_TCP, 
-                    OUT_TCP, 
-                    DONE};
-
-                void transition_udp_state();
             private:
 
-                std::mutex _mutex;
+                mutable std::mutex _mutex;
 
-                receive_state _rstate;
-                assignment_map _out;
+                //transports push here from their own threads, so it goes before them
+                inbound_queue _inbound;
+                tcp_service_ptr _tcp_service;
+                size_t _pool_max;
+                tcp_pool_limits _pool_limits;
                 tcp_connection_pool _pool;
+                tcp_pool_index _out; //address to its place in _pool
+                tcp_connect_stats _closed_tcp_stats; //of queues gone from the pool
+
+                //the sweep closes queues, which waits on their io threads, so it has its own.
+                //destinations whose connection was full are retried on it too
+                tcp_service_ptr _pool_service;
+                boost::asio::io_service& _pool_io;
+                boost::asio::steady_timer _pool_timer; //closes idle connections
+                bool _pool_closed = false; //touched only on the timer's thread
                 port_type _local_port;
                 tcp_queue_ptr _in;
                 udp_queue_ptr _udp_con;
+                size_t _udp_shards;
+                size_t _udp_upload_rate;
                 bool _tcp_listen;
 
                 connection_map _in_connections;
 
                 //to prevent tcp connections from mess'in with udp
                 bool _done;
-                send_queue _tcp_send_queue;
-                util::thread_uptr _tcp_send_thread;
-                friend void tcp_send_thread(connection_manager*);
+                tcp_send_limits _tcp_limits;
+                tcp_destinations _tcp_destinations;
+                tcp_destination_queue _tcp_ready; //destinations with messages for a worker
+                std::mutex _tcp_send_mutex;
+                stream_manager _streams;
+                std::vector<util::thread_uptr> _tcp_send_workers;
+                friend void tcp_send_worker(connection_manager*);
         };
     }
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/inbound_queue.hpp"
+#include "util/dbc.hpp"
+
+namespace fire
+{
+    namespace network
+    {
+        inbound_queue::inbound_queue(const inbound_weights& w) :
+            _weights{{w.udp, w.tcp}}
+        {
+            REQUIRE_GREATER(w.udp, 0);
+            REQUIRE_GREATER(w.tcp, 0);
+
+            _credit = _weights[_turn];
+        }
+
+        void inbound_queue::push(inbound_message& m)
+        {
+            REQUIRE_RANGE(m.via, 0, inbound_message::transports);
+
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _lanes[m.via].emplace_back(std::move(m));
+                _size++;
+            }
+            _ready.notify_one();
+        }
+
+        bool inbound_queue::pop(inbound_message& m, clock::time_point until)
+        {
+            std::unique_lock<std::mutex> l(_mutex);
+            while(_size == 0)
+            {
+                if(_done) return false;
+                if(_ready.wait_until(l, until) == std::cv_status::timeout && _size == 0) 
+                    return false;
+            }
+
+            return take(m);
+        }
+
+        bool inbound_queue::take(inbound_message& m)
+        {
+            REQUIRE_GREATER(_size, 0);
+
+            //a lane keeps its turn until it runs out of credit or messages
+            for(size_t i = 0; i <= _lanes.size(); i++)
+            {
+                auto& l = _lanes[_turn];
+                if(_credit > 0 && !l.empty())
+                {
+                    m = std::move(l.front());
+                    l.pop_front();
+                    _credit--;
+                    _size--;
+                    return true;
+                }
+
+                _turn = (_turn + 1) % _lanes.size();
+                _credit = _weights[_turn];
+            }
+
+            CHECK(false && "messages counted but not in any lane");
+            return false;
+        }
+
+        void inbound_queue::done()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _done = true;
+            }
+            _ready.notify_all();
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_INBOUND_QUEUE_H
+#define FIRESTR_NETWORK_INBOUND_QUEUE_H
+
+#include "network/connection.hpp"
+#include "network/endpoint.hpp"
+#include "util/bytes.hpp"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace fire
+{
+    namespace network
+    {
+        struct inbound_message
+        {
+            enum transport { udp, tcp, transports };
+
+            transport via = udp;
+            endpoint ep;
+            util::bytes data;
+            bool stream = false; //carries a stream frame, see stream.hpp
+
+            //incoming tcp connection to answer over
+            connection* from = nullptr;
+        };
+
+        //share of the receives each transport gets while more than one has messages waiting
+        struct inbound_weights
+        {
+            size_t udp = 8;
+            size_t tcp = 1;
+        };
+
+        //messages from every transport, pushed by their threads as they arrive.
+        //each transport has its own lane and lanes take turns by weight
+        class inbound_queue
+        {
+            public:
+                using clock = std::chrono::steady_clock;
+
+                inbound_queue(const inbound_weights& w = {});
+
+            public:
+                void push(inbound_message& m);
+                bool pop(inbound_message& m, clock::time_point until);
+                void done();
+
+            private:
+                bool take(inbound_message& m);
+
+            private:
+                using lane = std::deque<inbound_message>;
+
+                std::array<lane, inbound_message::transports> _lanes;
+                std::array<size_t, inbound_message::transports> _weights;
+                size_t _turn = 0; //lane being served
+                size_t _credit = 0; //messages left in its turn
+                size_t _size = 0;
+                bool _done = false;
+
+                std::mutex _mutex;
+                std::condition_variable _ready;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/stream.hpp"
+#include "network/message_queue.hpp"
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace u = fire::util;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const size_t SEGMENT_SIZE = 64 * 1024; //most data bytes in one frame
+            const size_t CREDIT_STEP = STREAM_WINDOW / 4; //bytes read before the writer gets more room
+            const size_t MAX_STREAMS = 64; //streams being read at once
+            const auto STREAM_TIMEOUT = std::chrono::seconds(60); //stream dropped after no progress for this long
+
+            //udp gives up on a message after 5 seconds unacked and drops a partial
+            //one after 10, so a frame still missing after this is never coming
+            const auto GAP_TIMEOUT = std::chrono::seconds(15);
+            const auto SWEEP_INTERVAL = std::chrono::seconds(1); //between checks for stalled streams
+
+            const size_t ID_BASE = 1;
+            const size_t OFFSET_BASE = ID_BASE + sizeof(stream_id);
+            const size_t END_BASE = OFFSET_BASE + sizeof(stream_offset);
+            const size_t DATA_BASE = END_BASE + 1;
+
+            //<type> <stream id> <offset> <end>
+            const size_t FRAME_HEADER_SIZE = DATA_BASE;
+        }
+
+        //defined with the udp wire format
+        void write_be_u64(u::bytes& b, size_t offset, uint64_t v);
+        void read_be_u64(const char* b, size_t size, size_t offset, uint64_t& v);
+
+        u::bytes encode_stream_frame(const stream_frame& f)
+        {
+            u::bytes r(FRAME_HEADER_SIZE + f.data.size());
+
+            switch(f.type)
+            {
+                case stream_frame::payload: r[0] = 'd'; break;
+                case stream_frame::credit: r[0] = 'c'; break;
+                case stream_frame::reset: r[0] = 'r'; break;
+                default: CHECK(false && "missed case");
+            }
+
+            write_be_u64(r, ID_BASE, f.id);
+            write_be_u64(r, OFFSET_BASE, f.offset);
+            r[END_BASE] = f.end ? 1 : 0;
+            std::copy(f.data.begin(), f.data.end(), r.begin() + DATA_BASE);
+            return r;
+        }
+
+        bool decode_stream_frame(const u::bytes& b, stream_frame& f)
+        {
+            if(b.size() < FRAME_HEADER_SIZE) return false;
+
+            switch(b[0])
+            {
+                case 'd': f.type = stream_frame::payload; break;
+                case 'c': f.type = stream_frame::credit; break;
+                case 'r': f.type = stream_frame::reset; break;
+                default: return false;
+            }
+
+            read_be_u64(b.data(), b.size(), ID_BASE, f.id);
+            read_be_u64(b.data(), b.size(), OFFSET_BASE, f.offset);
+            f.end = b[END_BASE] != 0;
+            f.data.assign(b.begin() + DATA_BASE, b.end());
+            return true;
+        }
+
+        stream_manager::stream_manager(frame_sender s) : _send{s}
+        {
+            REQUIRE(_send);
+        }
+
+        //credit comes from the address the transport saw, which is resolved,
+        //so writers are keyed by the resolved address too
+        std::string stream_manager::writer_address(const std::string& to)
+        {
+            auto a = parse_address(to);
+            return make_address_str({a.transport, resolve(a.host), a.port});
+        }
+
+        std::string stream_manager::writer_key(const endpoint& from)
+        {
+            return make_address_str({from.protocol, resolve(from.address), from.port});
+        }
+
+        std::string stream_manager::resolve(const std::string& host)
+        {
+            boost::system::error_code error;
+            boost::asio::ip::address::from_string(host, error);
+            if(!error) return host;
+
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                auto r = _resolved.find(host);
+                if(r != _resolved.end()) return r->second;
+            }
+
+            //looking up the host can take a while, so it is done outside the lock.
+            //the first address is the one the udp queue sends to
+            std::string address = host;
+            boost::asio::io_service io;
+            boost::asio::ip::udp::resolver resolver{io};
+            auto i = resolver.resolve(boost::asio::ip::udp::resolver::query{host, "0"}, error);
+            if(!error && i != boost::asio::ip::udp::resolver::iterator{}) 
+                address = i->endpoint().address().to_string();
+
+            std::lock_guard<std::mutex> l(_mutex);
+            _resolved[host] = address;
+            return address;
+        }
+
+        send_status stream_manager::send(
+                const std::string& to, 
+                stream_id id, 
+                const u::bytes& data, 
+                bool end, 
+                bool block)
+        {
+            INVARIANT(_send);
+            if(data.size() > STREAM_WINDOW)
+            {
+                LOG << "stream write of `" << data.size() << "' bytes is larger than the stream window of `" << STREAM_WINDOW << "'" << std::endl;
+                return send_status::failed;
+            }
+
+            const stream_key key{writer_address(to), id};
+            stream_offset offset = 0;
+            {
+                std::unique_lock<std::mutex> l(_mutex);
+                if(_closed) return send_status::failed;
+
+                auto& w = _writers[key];
+                auto room = [&]{ return _closed || w.failed || w.next + data.size() <= w.limit;};
+                if(!room())
+                {
+                    if(!block) return send_status::would_block;
+                    if(!_credited.wait_for(l, STREAM_TIMEOUT, room))
+                    {
+                        LOG << "stream " << id << " to `" << to << "' got no credit for too long, dropping it" << std::endl;
+                        _writers.erase(key);
+                        return send_status::failed;
+                    }
+                    if(_closed) return send_status::failed;
+                }
+
+                if(w.failed)
+                {
+                    LOG << "stream " << id << " to `" << to << "' was reset by the reader" << std::endl;
+                    _writers.erase(key);
+                    return send_status::failed;
+                }
+
+                //claim the range so frames can go out without holding the lock
+                offset = w.next;
+                w.next += data.size();
+                if(end) _writers.erase(key);
+            }
+
+            stream_frame f;
+            f.id = id;
+            size_t sent = 0;
+            do
+            {
+                const size_t size = std::min(SEGMENT_SIZE, data.size() - sent);
+                f.offset = offset + sent;
+                f.data.assign(data.begin() + sent, data.begin() + sent + size);
+                sent += size;
+                f.end = end && sent == data.size();
+
+                if(!_send(to, encode_stream_frame(f))) return send_status::failed;
+            }
+            while(sent < data.size());
+
+            return send_status::queued;
+        }
+
+        void stream_manager::received(const endpoint& from, const u::bytes& b)
+        {
+            stream_frame f;
+            if(!decode_stream_frame(b, f)) return;
+
+            switch(f.type)
+            {
+                case stream_frame::payload: received_data(from, f); break;
+                case stream_frame::credit: received_credit(from, f); break;
+                case stream_frame::reset: received_reset(from, f); break;
+                default: CHECK(false && "missed case");
+            }
+        }
+
+        void stream_manager::received_credit(const endpoint& from, const stream_frame& f)
+        {
+            const auto address = writer_key(from);
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                auto w = _writers.find({address, f.id});
+                if(w == _writers.end()) return;
+                if(f.offset <= w->second.limit) return;
+
+                w->second.limit = f.offset;
+            }
+            _credited.notify_all();
+        }
+
+        void stream_manager::received_reset(const endpoint& from, const stream_frame& f)
+        {
+            const auto address = writer_key(from);
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                auto w = _writers.find({address, f.id});
+                if(w == _writers.end()) return;
+
+                w->second.failed = true;
+            }
+            _credited.notify_all();
+        }
+
+        void stream_manager::received_data(const endpoint& from, stream_frame& f)
+        {
+            const auto now = stream_clock::now();
+            const stream_key key{make_address_str(from), f.id};
+
+            std::unique_lock<std::mutex> l(_mutex);
+            auto r = _readers.find(key);
+            if(r == _readers.end())
+            {
+                if(_readers.size() >= MAX_STREAMS) evict_stale(now);
+                if(_readers.size() >= MAX_STREAMS)
+                {
+                    LOG << "dropping stream " << f.id << " from `" << key.first << "', reading too many streams" << std::endl;
+                    return;
+                }
+                r = _readers.emplace(key, stream_reader{}).first;
+            }
+
+            auto& s = r->second;
+
+            //frames of a failed stream still in flight. the reader is kept
+            //until it goes stale so they do not start the stream over
+            if(s.failed) return;
+            s.last_seen = now;
+
+            //the writer cannot go past what we allowed, so this is all we ever hold
+            if(f.offset + f.data.size() > s.limit)
+            {
+                LOG << "stream " << f.id << " from `" << key.first << "' went past its window" << std::endl;
+                return;
+            }
+
+            //duplicate or after the end
+            if(f.offset < s.next || s.ended) return;
+
+            if(f.offset > s.next)
+            {
+                if(s.early.empty()) s.gap_since = now;
+                s.early.emplace(f.offset, std::move(f));
+
+                //the frame at next was lost for good
+                if(now - s.gap_since <= GAP_TIMEOUT) return;
+
+                LOG << "stream " << key.second << " from `" << key.first << "' is missing data at " << s.next << ", failing it" << std::endl;
+                fail(key, s);
+                l.unlock();
+                send_resets({key});
+                return;
+            }
+
+            deliver(from, s, f);
+            while(!s.early.empty() && s.early.begin()->first <= s.next)
+            {
+                auto e = s.early.begin();
+                if(e->first == s.next && !s.ended) deliver(from, s, e->second);
+                s.early.erase(e);
+            }
+
+            //the wait starts over for whatever is missing now
+            if(!s.early.empty()) s.gap_since = now;
+        }
+
+        void stream_manager::fail(const stream_key& key, stream_reader& r)
+        {
+            REQUIRE_FALSE(r.failed);
+
+            auto a = parse_address(key.first);
+            stream_segment s;
+            s.ep = endpoint{a.transport, a.host, a.port};
+            s.id = key.second;
+            s.offset = r.next;
+            s.end = true;
+            s.failed = true;
+            _ready.emplace_back(std::move(s));
+
+            r.failed = true;
+            r.ended = true;
+            r.early.clear();
+
+            ENSURE(r.early.empty());
+        }
+
+        void stream_manager::send_resets(const std::vector<stream_key>& keys)
+        {
+            INVARIANT(_send);
+
+            stream_frame reset;
+            reset.type = stream_frame::reset;
+            for(const auto& k : keys)
+            {
+                reset.id = k.second;
+                _send(k.first, encode_stream_frame(reset));
+            }
+        }
+
+        //streams with a hole that is not going to fill
+        std::vector<stream_key> stream_manager::fail_stalled(stream_time now)
+        {
+            std::vector<stream_key> failed;
+            if(now < _next_sweep) return failed;
+            _next_sweep = now + SWEEP_INTERVAL;
+
+            for(auto& r : _readers)
+            {
+                auto& s = r.second;
+                if(s.failed || s.ended) continue;
+
+                if(s.early.empty() || now - s.gap_since <= GAP_TIMEOUT) continue;
+
+                LOG << "stream " << r.first.second << " from `" << r.first.first << "' is missing data at " << s.next << ", failing it" << std::endl;
+                fail(r.first, s);
+                failed.push_back(r.first);
+            }
+            return failed;
+        }
+
+        void stream_manager::deliver(const endpoint& from, stream_reader& r, stream_frame& f)
+        {
+            REQUIRE_EQUAL(f.offset, r.next);
+
+            r.next += f.data.size();
+            r.ended = f.end;
+            _ready.emplace_back(stream_segment{from, f.id, f.offset, std::move(f.data), f.end});
+        }
+
+        bool stream_manager::receive(stream_segment& seg)
+        {
+            INVARIANT(_send);
+
+            std::string to;
+            stream_frame credit;
+            credit.type = stream_frame::credit;
+            std::vector<stream_key> stalled;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+
+                //apps poll for segments, so a hole with nothing arriving after it is caught here
+                stalled = fail_stalled(stream_clock::now());
+            }
+            send_resets(stalled);
+
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                if(_ready.empty()) return false;
+
+                seg = std::move(_ready.front());
+                _ready.pop_front();
+
+                auto r = _readers.find({make_address_str(seg.ep), seg.id});
+                if(r == _readers.end()) return true;
+
+                //the app has the whole stream. a failed one stays until stale
+                auto& s = r->second;
+                if(seg.failed) return true;
+                if(seg.end) 
+                {
+                    _readers.erase(r);
+                    return true;
+                }
+
+                s.read += seg.data.size();
+                if(s.read + STREAM_WINDOW - s.limit < CREDIT_STEP) return true;
+
+                s.limit = s.read + STREAM_WINDOW;
+                credit.id = seg.id;
+                credit.offset = s.limit;
+                to = r->first.first;
+            }
+
+            _send(to, encode_stream_frame(credit));
+            return true;
+        }
+
+        void stream_manager::evict_stale(stream_time now)
+        {
+            for(auto r = _readers.begin(); r != _readers.end();)
+            {
+                if(now - r->second.last_seen > STREAM_TIMEOUT) 
+                {
+                    LOG << "dropping stream " << r->first.second << " from `" << r->first.first << "', no progress" << std::endl;
+                    r = _readers.erase(r);
+                }
+                else r++;
+            }
+        }
+
+        void stream_manager::close()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _closed = true;
+            }
+            _credited.notify_all();
+        }
+    }
+}
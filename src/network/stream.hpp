@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_STREAM_H
+#define FIRESTR_NETWORK_STREAM_H
+
+#include "network/connection.hpp"
+#include "network/endpoint.hpp"
+#include "util/bytes.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fire
+{
+    namespace network
+    {
+        using stream_id = uint64_t;
+        using stream_offset = uint64_t;
+
+        //bytes of a stream the reader holds before the app takes them.
+        //a writer is never further than this ahead of the app on the other side
+        const size_t STREAM_WINDOW = 4 * 1024 * 1024;
+
+        //in order piece of a stream given to the app
+        struct stream_segment
+        {
+            endpoint ep;
+            stream_id id = 0;
+            stream_offset offset = 0;
+            util::bytes data;
+            bool end = false; //last segment of the stream
+            bool failed = false; //stream was cut short, data before offset is all there is
+        };
+
+        //sent as a message on the transport, either data, the reader raising the writer's limit,
+        //or the reader giving up on the stream
+        struct stream_frame
+        {
+            enum frame_type { payload, credit, reset } type = payload;
+            stream_id id = 0;
+            stream_offset offset = 0; //of the data, or the new limit for credit
+            bool end = false;
+            util::bytes data;
+        };
+
+        util::bytes encode_stream_frame(const stream_frame&);
+        bool decode_stream_frame(const util::bytes&, stream_frame&);
+
+        using stream_clock = std::chrono::steady_clock;
+        using stream_time = stream_clock::time_point;
+
+        struct stream_writer
+        {
+            stream_offset next = 0;
+            stream_offset limit = STREAM_WINDOW;
+            bool failed = false; //reader gave up on the stream
+        };
+
+        using early_frames = std::map<stream_offset, stream_frame>;
+        struct stream_reader
+        {
+            stream_offset next = 0; //next offset handed to the app in order
+            stream_offset read = 0; //bytes the app has taken
+            stream_offset limit = STREAM_WINDOW; //last limit given to the writer
+            early_frames early; //arrived ahead of next
+            bool ended = false;
+            bool failed = false;
+            stream_time last_seen;
+            stream_time gap_since; //when frames started waiting on a missing one
+        };
+
+        using stream_key = std::pair<std::string, stream_id>;
+        using stream_writers = std::map<stream_key, stream_writer>;
+        using stream_readers = std::map<stream_key, stream_reader>;
+        using stream_segments = std::deque<stream_segment>;
+
+        //ordered, flow controlled streams of any length over message transports.
+        //frames go out through the sender given, and frames from the transport 
+        //come in through received. memory held per stream is bounded by STREAM_WINDOW
+        class stream_manager
+        {
+            public:
+                using frame_sender = std::function<bool(const std::string& to, const util::bytes&)>;
+                stream_manager(frame_sender);
+
+            public:
+                send_status send(
+                        const std::string& to, 
+                        stream_id id, 
+                        const util::bytes& data, 
+                        bool end, 
+                        bool block);
+                void received(const endpoint& from, const util::bytes& frame);
+                bool receive(stream_segment& s);
+                void close();
+
+            private:
+                void received_data(const endpoint& from, stream_frame& f);
+                void received_credit(const endpoint& from, const stream_frame& f);
+                void received_reset(const endpoint& from, const stream_frame& f);
+                void deliver(const endpoint& from, stream_reader& r, stream_frame& f);
+                void evict_stale(stream_time now);
+                std::vector<stream_key> fail_stalled(stream_time now);
+                void fail(const stream_key&, stream_reader&);
+                void send_resets(const std::vector<stream_key>&);
+                std::string writer_key(const endpoint&);
+                std::string writer_address(const std::string& to);
+                std::string resolve(const std::string& host);
+
+            private:
+                frame_sender _send;
+                stream_writers _writers;
+                stream_readers _readers;
+                std::map<std::string, std::string> _resolved; //host names writers were given
+                stream_segments _ready;
+                bool _closed = false;
+                stream_time _next_sweep;
+                std::mutex _mutex;
+                std::condition_variable _credited;
+        };
+    }
+}
+
+#endif
@@ -40,6 +40,7 @@
 #include <sstream>
 #include <algorithm>
 #include <functional>
+#include <future>
 #include <boost/lexical_cast.hpp>
 #include <boost/bind.hpp>
 
@@ -59,42 +60,84 @@ namespace fire
     {
         namespace
         {
-            const size_t BLOCK_SLEEP = 10;
-            const size_t THREAD_SLEEP = 40;
-            const size_t KEEP_ALIVE_SLEEP = 2000;
-            const size_t KEEP_ALIVE_THRESH = 30;
+            const size_t SEND_BUDGET = 16 * 1024 * 1024; //bytes queued before senders wait
+            const auto KEEP_ALIVE_INTERVAL = std::chrono::seconds(60); //a peer silent this long is dropped
             const u::bytes KEEP_ALIVE_MSG {'%', 'k'};
             const u::bytes KEEP_ALIVE_ACK_MSG {'%', 'a'};
-            const int RETRIES = 0;
+
+            //failed connects are retried on a timer, backing off exponentially. 
+            //the jitter spreads out peers that lost the same host at once
+            const int RETRIES = 4;
+            const auto RETRY_BASE = std::chrono::milliseconds(250);
+            const auto RETRY_MAX = std::chrono::milliseconds(8000);
+
+            //text frames are `!<size>:<body>'. a peer that can read binary frames says so 
+            //with a byte old readers skip as noise, and a writer switches with an empty
+            //`#' frame. binary frames are the mark and a 4 byte big endian size
+            const char MESSAGE_MARK = '!';
+            const char STREAM_MARK = '$';
+            const char BINARY_OFFER = '~';
+            const char BINARY_SWITCH = '#';
+            const size_t FRAME_HEADER_SIZE = 5;
+
+            //largest frame either side takes. the size comes from the peer, so a reader 
+            //holds no more than this for it. well above the largest udp message
+            const size_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+            //queued messages gathered into one write. a larger message still goes alone
+            const size_t MAX_GATHER_BYTES = 256 * 1024;
+            const size_t MAX_GATHER_MESSAGES = 32; //two buffers each keeps a write to one writev
         }
 
         tcp_connection::tcp_connection(
                 ba::io_service& io, 
                 byte_queue& in,
+                tcp_stream_queue& in_streams,
                 tcp_connection_ptr_queue& last_in,
                 std::mutex& in_mutex,
+                const tcp_receive_handler& receive,
                 bool track,
-                bool con) :
+                bool con,
+                bool no_delay) :
             _state{ con ? connected : disconnected},
             _io(io),
             _in_queue(in),
+            _in_streams(in_streams),
             _in_mutex(in_mutex),
+            _receive(receive),
+            _budget{SEND_BUDGET},
             _last_in_socket(last_in),
             _track{track},
             _socket{new tcp::socket{io}},
             _writing{false},
-            _retries{RETRIES}
+            _no_delay{no_delay},
+            _retries{RETRIES},
+            _retry_timer{io},
+            _jitter{std::random_device{}()}
         {
             INVARIANT(_socket);
         }
 
+        tcp_connect_stats& tcp_connect_stats::operator+=(const tcp_connect_stats& o)
+        {
+            attempts += o.attempts;
+            connected += o.connected;
+            retried += o.retried;
+            gave_up += o.gave_up;
+            connecting += o.connecting;
+            return *this;
+        }
+
         tcp_connection::~tcp_connection()
         {
-            close();
+            //the queue has closed the socket on its io thread by now, 
+            //and nothing may be posted for an object going away
+            _budget.close();
         }
 
         void tcp_connection::close()
         {
+            _budget.close();
             _state = disconnected;
             _writing = false;
             _io.post(boost::bind(&tcp_connection::do_close, this));
@@ -105,13 +148,18 @@ namespace fire
             u::mutex_scoped_lock l(_mutex);
             _state = disconnected;
             _writing = false;
+
+            boost::system::error_code te;
+            _retry_timer.cancel(te);
+
             if(_socket && _socket->is_open())
             {
                 boost::system::error_code se;
                 _socket->shutdown(ba::ip::tcp::socket::shutdown_both, se);
                 _socket->close();
                 if(se) _error = se;
-                LOG << "tcp_connection closed " << _socket->local_endpoint() << " + " << _socket->remote_endpoint() << " error: " << _error.message() << std::endl;
+                //the socket no longer has endpoints to ask for once closed
+                LOG << "tcp_connection closed " << _ep.address << ":" << _ep.port << " error: " << _error.message() << std::endl;
             }
             else
             {
@@ -142,6 +190,19 @@ namespace fire
             return _state;
         }
 
+        tcp_connect_stats tcp_connection::connect_stats() const
+        {
+            u::mutex_scoped_lock l(_mutex);
+            auto s = _connect_stats;
+            s.connecting = _state == connecting ? 1 : 0;
+            return s;
+        }
+
+        size_t tcp_connection::queued_bytes() const
+        {
+            return _budget.used();
+        }
+
         void tcp_connection::bind(port_type port)
         {
             u::mutex_scoped_lock l(_mutex);
@@ -178,20 +239,89 @@ namespace fire
                     _socket.reset(new tcp::socket{_io});
 
                 _state = connecting;
+                _retries = RETRIES;
+                reset_framing();
             }
+            _budget.open();
 
-             LOG << "tcp connecting to " << _ep.address << ":" << _ep.port << " (" << endpoint << ")" <<std::endl;
+            start_connect(endpoint);
+        }
+
+        void tcp_connection::start_connect(tcp::endpoint endpoint)
+        {
+            INVARIANT(_socket);
+
+            {
+                u::mutex_scoped_lock l(_mutex);
+                _connect_stats.attempts++;
+            }
+
+            LOG << "tcp connecting to " << _ep.address << ":" << _ep.port << " (" << endpoint << ")" <<std::endl;
 
             _socket->async_connect(endpoint,
                     boost::bind(&tcp_connection::handle_connect, this,
                         ba::placeholders::error, endpoint));
         }
 
+        void tcp_connection::schedule_retry(tcp::endpoint endpoint)
+        {
+            REQUIRE_GREATER(_retries, 0);
+
+            const int attempt = RETRIES - _retries;
+            const auto backoff = std::min(RETRY_MAX, RETRY_BASE * (1 << attempt));
+            std::uniform_int_distribution<int> jitter(backoff.count() / 2, backoff.count());
+            const auto wait = std::chrono::milliseconds(jitter(_jitter));
+
+            {
+                u::mutex_scoped_lock l(_mutex);
+                _retries--;
+                _connect_stats.retried++;
+            }
+
+            LOG << "retrying " << _ep.address << ":" << _ep.port << " in " << wait.count() << "ms (" << (attempt + 1) << "/" << RETRIES << ")..." << std::endl;
+
+            //wait on the timer so the io thread keeps serving other connections
+            _retry_timer.expires_after(wait);
+            _retry_timer.async_wait(
+                    boost::bind(&tcp_connection::handle_retry, this,
+                        ba::placeholders::error, endpoint));
+        }
+
+        void tcp_connection::handle_retry(
+                const boost::system::error_code& error,
+                tcp::endpoint endpoint)
+        {
+            //cancelled when the connection closes
+            if(error) return;
+
+            INVARIANT(_socket);
+            if(_state != connecting) return;
+            if(!_socket->is_open()) { close(); return; }
+
+            start_connect(endpoint);
+        }
+
+        void tcp_connection::set_socket_options()
+        {
+            INVARIANT(_socket);
+
+            //writes are already gathered here, so nagle would only add delay
+            boost::system::error_code error;
+            _socket->set_option(tcp::no_delay(_no_delay), error);
+            if(error) LOG << "unable to set tcp no delay: " << error.message() << std::endl;
+        }
+
         void tcp_connection::start_read()
         {
             INVARIANT(_socket);
             if(!_socket->is_open()) { close(); return; }
 
+            if(_in_binary) 
+            {
+                read_frame_header();
+                return;
+            }
+
             //read message header
             ba::async_read_until(*_socket, _in_buffer, ':',
                     boost::bind(&tcp_connection::handle_header, this,
@@ -213,8 +343,10 @@ namespace fire
                 {
                     u::mutex_scoped_lock l(_mutex);
                     _state = connected;
+                    _connect_stats.connected++;
                 }
                 LOG << "new out tcp_connection " << _socket->local_endpoint() << " -> " << _socket->remote_endpoint() << ": " << error.message() << std::endl;
+                set_socket_options();
                 start_read();
 
                 //if we have called send already before we connected,
@@ -224,54 +356,103 @@ namespace fire
             }
             else 
             {
-                if(_retries > 0)
                 {
-                    LOG << "retrying (" << (RETRIES - _retries) << "/" << RETRIES << ")..." << std::endl;
-                    {
-                        {
-                            u::mutex_scoped_lock l(_mutex);
-                            _retries--;
-                            _state = disconnected;
-                        }
-                        u::sleep_thread(2000);
-                    }
-                    connect(endpoint);
+                    u::mutex_scoped_lock l(_mutex);
+                    _error = error;
+                    LOG << "error connecting to `" << _ep.address << ":" << _ep.port << "' : " << error.message() << std::endl;
                 }
+
+                if(_retries > 0) schedule_retry(endpoint);
                 else
                 {
                     {
                         u::mutex_scoped_lock l(_mutex);
-                        _error = error;
-                        LOG << "error connecting to `" << _ep.address << ":" << _ep.port << "' : " << error.message() << std::endl;
+                        _connect_stats.gave_up++;
                     }
                     close();
                 }
             }
         }
 
-        u::bytes encode_tcp_wire(const u::bytes data)
+        void encode_tcp_wire(u::bytes& encoded, const tcp_message& msg)
+        {
+            auto m = u::encode(msg.data);
+            encoded.push_back(msg.stream ? STREAM_MARK : MESSAGE_MARK);
+            encoded.insert(encoded.end(), m.begin(), m.end());
+        }
+
+        //the body goes out from the message itself
+        void encode_tcp_frame_header(u::bytes& encoded, const tcp_message& msg)
+        {
+            REQUIRE_LESS_EQUAL(msg.data.size(), MAX_FRAME_SIZE);
+
+            const uint32_t size = msg.data.size();
+            encoded.push_back(msg.stream ? STREAM_MARK : MESSAGE_MARK);
+            for(int shift = 24; shift >= 0; shift -= 8) 
+                encoded.push_back(static_cast<char>((size >> shift) & 0xff));
+        }
+
+        size_t decode_tcp_frame_size(const std::array<char, 5>& h)
+        {
+            size_t size = 0;
+            for(size_t i = 1; i < FRAME_HEADER_SIZE; i++) 
+                size = (size << 8) | static_cast<unsigned char>(h[i]);
+            return size;
+        }
+
+        void tcp_connection::reset_framing()
         {
-            auto m = u::encode(data);
-            u::bytes encoded;
-            encoded.resize(m.size() + 1);
-            encoded[0] = '!';
-            std::copy(m.begin(), m.end(), encoded.begin() + 1);
-            return encoded;
+            _offered = false;
+            _peer_binary = false;
+            _out_binary = false;
+            _in_binary = false;
+            _in_buffer.consume(_in_buffer.size());
         }
 
         bool tcp_connection::send(const u::bytes& b, bool block)
+        {
+            if(too_big(b)) return false;
+
+            //if we are blocking, wait for earlier messages to drain
+            _budget.take(b.size(), block);
+            queue_message({b, false});
+            return is_connected();
+        }
+
+        send_status tcp_connection::try_send(const u::bytes& b)
+        {
+            if(too_big(b)) return send_status::failed;
+            if(!_budget.try_take(b.size())) return send_status::would_block;
+            queue_message({b, false});
+            return is_disconnected() ? send_status::failed : send_status::queued;
+        }
+
+        bool tcp_connection::send_stream(const u::bytes& frame)
+        {
+            if(too_big(frame)) return false;
+
+            //streams have their own flow control, so never wait here
+            _budget.take(frame.size(), false);
+            queue_message({frame, true});
+            return is_connected();
+        }
+
+        bool tcp_connection::too_big(const u::bytes& b) const
+        {
+            if(b.size() <= MAX_FRAME_SIZE) return false;
+
+            LOG << "tcp message of `" << b.size() << "' bytes is larger than the max of `" << MAX_FRAME_SIZE << "'" << std::endl;
+            return true;
+        }
+
+        void tcp_connection::queue_message(const tcp_message& m)
         {
             //add message to queue
-            _out_queue.push(b);
+            _out_queue.push(m);
 
             //do send if we are connected
             if(is_connected())
                 _io.post(boost::bind(&tcp_connection::do_send, this, false));
-
-            //if we are blocking, block until all messages are sent
-            while(block && !_out_queue.empty()) u::sleep_thread(BLOCK_SLEEP);
-
-            return is_connected();
         }
 
         void tcp_connection::send_keep_alive()
@@ -306,28 +487,89 @@ namespace fire
             REQUIRE_FALSE(_out_queue.empty());
             _writing = true;
 
+            //take what is queued up to the gather limit
+            CHECK(_out_messages.empty());
+            size_t bytes = 0;
+            tcp_message m;
+            while(_out_messages.size() < MAX_GATHER_MESSAGES && _out_queue.pop(m))
+            {
+                if(!_out_messages.empty() && bytes + m.data.size() > MAX_GATHER_BYTES)
+                {
+                    _out_queue.emplace_front(m);
+                    break;
+                }
+                bytes += m.data.size();
+                _out_messages.emplace_back(std::move(m));
+            }
+            CHECK_FALSE(_out_messages.empty());
+
             //encode bytes to wire format
-            _out_buffer = encode_tcp_wire(_out_queue.front());
+            _out_buffer.clear();
+
+            if(!_offered)
+            {
+                _out_buffer.push_back(BINARY_OFFER);
+                _offered = true;
+            }
+
+            if(_peer_binary && !_out_binary)
+            {
+                const u::bytes to_binary{BINARY_SWITCH, '0', ':'};
+                _out_buffer.insert(_out_buffer.end(), to_binary.begin(), to_binary.end());
+                _out_binary = true;
+            }
+
+            //framing for every message goes in _out_buffer. binary frames 
+            //write their bodies straight from the messages in between
+            _out_buffers.clear();
+            if(_out_binary) 
+            {
+                const size_t prefix = _out_buffer.size();
+                for(const auto& om : _out_messages) encode_tcp_frame_header(_out_buffer, om);
+
+                for(size_t i = 0; i < _out_messages.size(); i++)
+                {
+                    const size_t start = i == 0 ? 0 : prefix + i * FRAME_HEADER_SIZE;
+                    const size_t end = prefix + (i + 1) * FRAME_HEADER_SIZE;
+                    _out_buffers.push_back(ba::buffer(_out_buffer.data() + start, end - start));
+                    if(!_out_messages[i].data.empty()) _out_buffers.push_back(ba::buffer(_out_messages[i].data));
+                }
+            }
+            else
+            {
+                for(const auto& om : _out_messages) encode_tcp_wire(_out_buffer, om);
+                _out_buffers.push_back(ba::buffer(_out_buffer));
+            }
 
             ENSURE(_writing);
-            ba::async_write(*_socket,
-                    ba::buffer(&_out_buffer[0], _out_buffer.size()),
+            ba::async_write(*_socket, _out_buffers,
                         boost::bind(&tcp_connection::handle_write, this,
                             ba::placeholders::error,
                             ba::placeholders::bytes_transferred));
         }
 
+        void tcp_connection::requeue_unsent()
+        {
+            //back at the front, in order, to go out if the connection comes back
+            for(auto m = _out_messages.rbegin(); m != _out_messages.rend(); m++)
+                _out_queue.emplace_front(*m);
+            _out_messages.clear();
+        }
+
         void tcp_connection::handle_write(const boost::system::error_code& error, size_t transferred)
         {
-            if(_state == disconnected) { CHECK_FALSE(_writing); return;}
-            if(error) { _error = error; close(); return; }
-            if(!_socket->is_open()) { close(); return; }
+            if(_state == disconnected) { CHECK_FALSE(_writing); requeue_unsent(); return;}
+            if(error) { _error = error; requeue_unsent(); close(); return; }
+            if(!_socket->is_open()) { requeue_unsent(); close(); return; }
 
             INVARIANT(_socket);
-            REQUIRE_FALSE(_out_queue.empty());
+            REQUIRE_FALSE(_out_messages.empty());
 
-            //remove sent message
-            _out_queue.pop_front();
+            //remove sent messages
+            size_t bytes = 0;
+            for(const auto& m : _out_messages) bytes += m.data.size();
+            _budget.give_back(bytes);
+            _out_messages.clear();
 
             //if we are done sending finish the async write chain
             if(_out_queue.empty()) 
@@ -356,13 +598,16 @@ namespace fire
             int c = in.get();
             size_t garbage = 1;
 
-            //find start of message
-            while(c != '!' && in.good()) 
+            //find start of message. an offer before it means the peer reads binary frames
+            while(c != MESSAGE_MARK && c != STREAM_MARK && c != BINARY_SWITCH && in.good()) 
             { 
+                if(c == BINARY_OFFER) _peer_binary = true;
                 c = in.get(); 
                 garbage++;
             }
             if(!in.good()) { start_read(); return;}
+            _in_stream = c == STREAM_MARK;
+            const bool to_binary = c == BINARY_SWITCH;
 
             //read size
             c = in.get();
@@ -377,6 +622,18 @@ namespace fire
 
             CHECK_EQUAL(_in_buffer.size(), o_size - rc - garbage);
 
+            //the peer writes binary frames from here on. 
+            //answer with ours if we have not yet
+            if(to_binary)
+            {
+                LOG << "binary tcp frames from " << _ep.address << ":" << _ep.port << std::endl;
+                _in_binary = true;
+                _peer_binary = true;
+                if(!_writing && !_out_queue.empty()) do_send(false);
+                start_read();
+                return;
+            }
+
             //otherwise we got a generic message and need to read the body.
             size_t size = 0; 
             try { size = lexical_cast<size_t>(size_buf); } catch (...){}
@@ -426,10 +683,21 @@ namespace fire
             data.resize(size);
             std::istream in(&_in_buffer);
             in.read(&data[0], size);
+            deliver(data);
+
+            //read next message
+            start_read();
+        }
 
+        void tcp_connection::deliver(u::bytes& data)
+        {
             //got keepalive or ack
-            if(data == KEEP_ALIVE_MSG) send_keep_alive_ack();
-            else if (data == KEEP_ALIVE_ACK_MSG) _alive = true;
+            if(!_in_stream && data == KEEP_ALIVE_MSG) send_keep_alive_ack();
+            else if (!_in_stream && data == KEEP_ALIVE_ACK_MSG) _alive = true;
+            //the owner takes messages as they arrive
+            else if(_receive) _receive(this, data, _in_stream);
+            //stream frames are kept apart from messages
+            else if(_in_stream) _in_streams.push({this, std::move(data)});
             //otherwise add message to in queue
             else
             {
@@ -437,8 +705,93 @@ namespace fire
                 _in_queue.emplace_push(data);
                 if(_track) _last_in_socket.push(this);
             }
+        }
+
+        size_t tcp_connection::take_buffered(char* dest, size_t size)
+        {
+            //bytes read past the switch to binary frames
+            const size_t n = std::min(size, _in_buffer.size());
+            if(n == 0) return 0;
+
+            ba::buffer_copy(ba::buffer(dest, n), _in_buffer.data());
+            _in_buffer.consume(n);
+            return n;
+        }
+
+        void tcp_connection::read_frame_header()
+        {
+            const size_t n = take_buffered(_in_header.data(), FRAME_HEADER_SIZE);
+            if(n == FRAME_HEADER_SIZE) 
+            {
+                handle_frame_header(boost::system::error_code(), 0);
+                return;
+            }
+
+            ba::async_read(*_socket,
+                    ba::buffer(_in_header.data() + n, FRAME_HEADER_SIZE - n),
+                    boost::bind(&tcp_connection::handle_frame_header, this,
+                        ba::placeholders::error,
+                        ba::placeholders::bytes_transferred));
+        }
+
+        void tcp_connection::handle_frame_header(const boost::system::error_code& error, size_t)
+        {
+            INVARIANT(_socket);
+            if(_state == disconnected) return;
+            if(error) { _error = error; close(); return; }
+            if(!_socket->is_open()) { close(); return; }
+
+            const char mark = _in_header[0];
+            const size_t size = decode_tcp_frame_size(_in_header);
+            if(mark != MESSAGE_MARK && mark != STREAM_MARK)
+            {
+                LOG << "bad tcp frame from " << _ep.address << ":" << _ep.port << ", closing" << std::endl;
+                close();
+                return;
+            }
+
+            if(size == 0)
+            {
+                start_read();
+                return;
+            }
+
+            //the size is the peer's word, so it is checked before anything is allocated
+            if(size > MAX_FRAME_SIZE)
+            {
+                LOG << "tcp frame of `" << size << "' bytes from " << _ep.address << ":" << _ep.port << " is too large, closing" << std::endl;
+                close();
+                return;
+            }
+
+            //the body is read in place and handed on without another copy
+            _in_stream = mark == STREAM_MARK;
+            _in_body.resize(size);
+            const size_t n = take_buffered(_in_body.data(), size);
+            if(n == size) 
+            {
+                handle_frame_body(boost::system::error_code(), 0);
+                return;
+            }
+
+            ba::async_read(*_socket,
+                    ba::buffer(_in_body.data() + n, size - n),
+                    boost::bind(&tcp_connection::handle_frame_body, this,
+                        ba::placeholders::error,
+                        ba::placeholders::bytes_transferred));
+        }
+
+        void tcp_connection::handle_frame_body(const boost::system::error_code& error, size_t)
+        {
+            INVARIANT(_socket);
+            if(_state == disconnected) return;
+            if(error) { _error = error; close(); return; }
+            if(!_socket->is_open()) { close(); return; }
+
+            u::bytes data;
+            data.swap(_in_body);
+            deliver(data);
 
-            //read next message
             start_read();
         }
 
@@ -479,11 +832,69 @@ namespace fire
             ENSURE_GREATER(_ep.port, 0);
         }
 
-        void tcp_run_thread(tcp_queue*);
-        void keep_alive_thread(tcp_queue*);
-        tcp_queue::tcp_queue(const asio_params& p) : 
+        tcp_service::tcp_service(size_t threads)
+        {
+            REQUIRE_GREATER(threads, 0);
+
+            for(size_t i = 0; i < threads; i++)
+            {
+                _ios.emplace_back(new ba::io_service);
+                _work.emplace_back(ba::make_work_guard(*_ios.back()));
+            }
+
+            for(auto& io : _ios)
+                _threads.emplace_back(new std::thread{[&s = *io]
+                {
+                    //runs until the service goes away. a handler that throws 
+                    //only loses itself
+                    while(true)
+                    try
+                    {
+                        s.run();
+                        break;
+                    }
+                    catch(std::exception& e)
+                    {
+                        LOG << "error in tcp thread. " << e.what() << std::endl;
+                    }
+                    catch(...)
+                    {
+                        LOG << "unknown error in tcp thread." << std::endl;
+                    }
+                }});
+
+            ENSURE_EQUAL(_ios.size(), threads);
+            ENSURE_EQUAL(_threads.size(), threads);
+        }
+
+        tcp_service::~tcp_service()
+        {
+            //a thread cannot wait for itself to leave run, so the last 
+            //owner lets go of the service from outside its threads
+            for(auto& io : _ios) REQUIRE_FALSE(io->get_executor().running_in_this_thread());
+
+            for(auto& w : _work) w.reset();
+            for(auto& io : _ios) io->stop();
+            for(auto& t : _threads) t->join();
+        }
+
+        ba::io_service& tcp_service::next()
+        {
+            u::mutex_scoped_lock l(_mutex);
+            auto& io = *_ios[_next];
+            _next = (_next + 1) % _ios.size();
+            return io;
+        }
+
+        tcp_queue::tcp_queue(
+                const asio_params& p, 
+                tcp_service_ptr service, 
+                tcp_receive_handler receive) : 
             _p(p), 
-            _io{new ba::io_service},
+            _service{service ? service : std::make_shared<tcp_service>()},
+            _receive{receive},
+            _io(_service->next()),
+            _keep_alive_timer{_io},
             _done{false}
         {
             switch(_p.mode)
@@ -494,32 +905,59 @@ namespace fire
                 default: CHECK(false && "missed case");
             }
 
-            if(_p.mode != asio_params::delayed_connect)
-            {
-                _run_thread.reset(new std::thread{tcp_run_thread, this});
-                _keep_alive_thread.reset(new std::thread{keep_alive_thread, this});
-            }
-
-            INVARIANT(_io);
-            INVARIANT(_p.mode == asio_params::delayed_connect || (_run_thread && _keep_alive_thread));
+            INVARIANT(_service);
         }
 
         tcp_queue::~tcp_queue() 
         {
-            INVARIANT(_io);
-            if(_out) _out->close();
+            INVARIANT(_service);
+            REQUIRE_FALSE(_io.get_executor().running_in_this_thread());
 
             _done = true;
-            _io->stop();
             if(_p.block) _in_queue.done();
             if(_p.wait > 0) u::sleep_thread(_p.wait);
-            if(_run_thread) _run_thread->join();
-            if(_keep_alive_thread) _keep_alive_thread->join();
+
+            //the io_service is shared, so our sockets are closed on its thread, and 
+            //the aborted handlers that queues run before anything here is freed.
+            //on its own io thread that cannot be waited for, so it is not destroyed there
+            run_on_io(_io, [this]{ shutdown();});
+            run_on_io(_io, []{});
+        }
+
+        void run_on_io(ba::io_service& io, std::function<void()> f)
+        {
+            REQUIRE(f);
+            if(io.get_executor().running_in_this_thread())
+            {
+                f();
+                return;
+            }
+
+            std::promise<void> done;
+            auto finished = done.get_future();
+            io.post([&]
+            {
+                try { f(); }
+                catch(std::exception& e)
+                {
+                    LOG << "error on tcp io thread. " << e.what() << std::endl;
+                }
+                done.set_value();
+            });
+            finished.wait();
+        }
+
+        void tcp_queue::shutdown()
+        {
+            boost::system::error_code ec;
+            _keep_alive_timer.cancel(ec);
+            if(_acceptor) _acceptor->close(ec);
+            if(_out) _out->do_close();
+            for(auto& c : _in_connections) c->do_close();
         }
 
         bool tcp_queue::send(const u::bytes& b)
         {
-            INVARIANT(_io);
             REQUIRE(_p.mode != asio_params::bind);
             CHECK(_out);
 
@@ -529,6 +967,33 @@ namespace fire
             return _out->send(b, _p.block);
         }
 
+        bool tcp_queue::send_stream(const u::bytes& frame)
+        {
+            REQUIRE(_p.mode != asio_params::bind);
+            CHECK(_out);
+
+            if(_out->is_disconnected() && _p.mode == asio_params::connect) 
+                connect();
+
+            return _out->send_stream(frame);
+        }
+
+        bool tcp_queue::receive_stream(tcp_stream_frame& f)
+        {
+            return _in_streams.pop(f);
+        }
+
+        send_status tcp_queue::try_send(const u::bytes& b)
+        {
+            REQUIRE(_p.mode != asio_params::bind);
+            CHECK(_out);
+
+            if(_out->is_disconnected() && _p.mode == asio_params::connect) 
+                connect();
+
+            return _out->try_send(b);
+        }
+
         bool tcp_queue::receive(u::bytes& b)
         {
             //return true if we got message
@@ -539,8 +1004,6 @@ namespace fire
         {
             REQUIRE(_p.mode == asio_params::delayed_connect);
             REQUIRE_FALSE(host.empty());
-            REQUIRE_FALSE(_run_thread);
-            INVARIANT(_io);
             REQUIRE(!_out || _out->state() == tcp_connection::disconnected);
 
             _p.uri = make_tcp_address(host, port);
@@ -548,12 +1011,6 @@ namespace fire
             _p.port = port;
             _p.mode = asio_params::connect;
             connect();
-
-            //start up engine
-            _run_thread.reset(new std::thread{tcp_run_thread, this});
-            _keep_alive_thread.reset(new std::thread{keep_alive_thread, this});
-            ENSURE(_run_thread);
-            ENSURE(_keep_alive_thread);
         }
 
         bool tcp_queue::is_connected()
@@ -571,13 +1028,22 @@ namespace fire
             return _out && _out->is_disconnected();
         }
 
+        tcp_connect_stats tcp_queue::connect_stats() const
+        {
+            return _out ? _out->connect_stats() : tcp_connect_stats{};
+        }
+
+        size_t tcp_queue::queued_bytes() const
+        {
+            return _out ? _out->queued_bytes() : 0;
+        }
+
         void tcp_queue::delayed_connect()
         try
         {
-            INVARIANT(_io);
             REQUIRE(!_out);
 
-            _out.reset(new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex});
+            _out.reset(new tcp_connection{_io, _in_queue, _in_streams, _last_in_socket, _mutex, _receive, false, false, _p.no_delay});
             if(_p.local_port > 0) _out->bind(_p.local_port);
 
             ENSURE(_out);
@@ -594,11 +1060,10 @@ namespace fire
         void tcp_queue::connect()
         try
         {
-            INVARIANT(_io);
             REQUIRE(!_out || _out->state() == tcp_connection::disconnected);
 
             //init resolver if it does not exist
-            if(!_resolver) _resolver.reset(new tcp::resolver{*_io}); 
+            if(!_resolver) _resolver.reset(new tcp::resolver{_io}); 
 
             tcp::resolver::query query{_p.host, port_to_string(_p.port)}; 
             auto ei = _resolver->resolve(query);
@@ -608,6 +1073,7 @@ namespace fire
 
             _out->update_endpoint(_p.host, _p.port);
             _out->connect(endpoint);
+            _io.post(boost::bind(&tcp_queue::start_keep_alive, this));
 
             ENSURE(_out);
             ENSURE(_resolver);
@@ -623,11 +1089,10 @@ namespace fire
 
         void tcp_queue::accept()
         {
-            INVARIANT(_io);
 
             if(!_acceptor) 
             {
-                _acceptor.reset(new tcp::acceptor{*_io});
+                _acceptor.reset(new tcp::acceptor{_io});
 
                 auto port = boost::lexical_cast<short unsigned int>(_p.port);
                 tcp::endpoint endpoint{tcp::v4(), port}; 
@@ -643,7 +1108,7 @@ namespace fire
             }
 
             //prepare incoming tcp_connection
-            tcp_connection_ptr new_connection{new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex, _p.track_incoming, true}};
+            tcp_connection_ptr new_connection{new tcp_connection{_io, _in_queue, _in_streams, _last_in_socket, _mutex, _receive, _p.track_incoming, true, _p.no_delay}};
             _acceptor->async_accept(new_connection->socket(),
                     bind(&tcp_queue::handle_accept, this, new_connection,
                         ba::placeholders::error));
@@ -656,6 +1121,7 @@ namespace fire
             REQUIRE(nc);
             INVARIANT(_acceptor);
 
+            if(error == ba::error::operation_aborted) return;
             if(error) 
             {
                 nc->_state = tcp_connection::disconnected;
@@ -666,10 +1132,11 @@ namespace fire
 
             _in_connections.push_back(nc);
             nc->update_endpoint();
+            nc->set_socket_options();
             nc->start_read();
 
             //prepare next incoming tcp_connection
-            tcp_connection_ptr new_connection{new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex, _p.track_incoming, true}};
+            tcp_connection_ptr new_connection{new tcp_connection{_io, _in_queue, _in_streams, _last_in_socket, _mutex, _receive, _p.track_incoming, true, _p.no_delay}};
             _acceptor->async_accept(new_connection->socket(),
                     boost::bind(&tcp_queue::handle_accept, this, new_connection,
                         ba::placeholders::error));
@@ -691,82 +1158,58 @@ namespace fire
             return p;
         }
 
-        void tcp_run_thread(tcp_queue* q)
+        void tcp_queue::start_keep_alive()
         {
-            CHECK(q);
-            CHECK(q->_io);
-            if(q->_out) q->_out->send_keep_alive();
+            if(_keep_alive_armed || !_out) return;
+            _out->send_keep_alive();
+            schedule_keep_alive();
+        }
 
-            while(!q->_done) 
-            try
-            {
-                q->_io->run();
-                u::sleep_thread(THREAD_SLEEP);
-                if(q->_out && q->_out->is_disconnected())
-                    break;
-            }
-            catch(std::exception& e)
-            {
-                LOG << "error in tcp thread. " << e.what() << std::endl;
-                if(q->_out) q->_out->close();
-            }
-            catch(...)
-            {
-                LOG << "unknown error in tcp thread." << std::endl;
-                if(q->_out) q->_out->close();
-            }
+        void tcp_queue::schedule_keep_alive()
+        {
+            _keep_alive_armed = true;
+            _keep_alive_timer.expires_after(KEEP_ALIVE_INTERVAL);
+            _keep_alive_timer.async_wait(
+                    boost::bind(&tcp_queue::handle_keep_alive, this,
+                        ba::placeholders::error));
         }
 
-        void keep_alive_thread(tcp_queue* q)
+        void tcp_queue::handle_keep_alive(const boost::system::error_code& error)
         {
-            CHECK(q);
-            size_t ticks = 0;
-            if(q->_out) q->_out->send_keep_alive();
+            _keep_alive_armed = false;
+            if(error || _done) return;
+            CHECK(_out);
 
-            while(!q->_done) 
-            try
-            {
-                //do keepalive
-                if(q->_out && !q->_out->is_disconnected() && ticks > KEEP_ALIVE_THRESH)
-                {
-                    if(q->_out->is_alive()) 
-                    {
-                        q->_out->send_keep_alive();
-                        q->_out->reset_alive();
-                    }
-                    else q->_out->close();
-                    ticks = 0;
-                }
-                ticks++;
-                u::sleep_thread(KEEP_ALIVE_SLEEP);
+            //stops with the connection, a reconnect starts it again
+            if(_out->is_disconnected()) return;
 
-                if(q->_out && q->_out->is_disconnected())
-                    break;
-            }
-            catch(std::exception& e)
+            if(_out->is_alive()) 
             {
-                LOG << "error in tcp thread. " << e.what() << std::endl;
-                if(q->_out) q->_out->close();
-            }
-            catch(...)
-            {
-                LOG << "unknown error in tcp thread." << std::endl;
-                if(q->_out) q->_out->close();
+                _out->send_keep_alive();
+                _out->reset_alive();
             }
+            else _out->close();
+
+            schedule_keep_alive();
         }
 
-        tcp_queue_ptr create_tcp_queue(const address_components& c)
+        tcp_queue_ptr create_tcp_queue(
+                const address_components& c, 
+                tcp_service_ptr service, 
+                tcp_receive_handler receive)
         {
             auto p = parse_params(c);
-            return tcp_queue_ptr{new tcp_queue{p}};
+            return tcp_queue_ptr{new tcp_queue{p, service, receive}};
         }
 
         tcp_queue_ptr create_tcp_queue(
                 const std::string& address, 
-                const queue_options& defaults)
+                const queue_options& defaults,
+                tcp_service_ptr service,
+                tcp_receive_handler receive)
         {
             auto c = parse_address(address, defaults); 
-            tcp_queue_ptr p = create_tcp_queue(c);
+            tcp_queue_ptr p = create_tcp_queue(c, service, receive);
             ENSURE(p);
             return p;
         }
@@ -36,6 +36,11 @@
 #include "network/message_queue.hpp"
 #include "util/thread.hpp"
 
+#include <array>
+#include <functional>
+#include <mutex>
+#include <random>
+
 namespace fire
 {
     namespace network
@@ -49,6 +54,37 @@ namespace fire
         using tcp_connection_ptr_queue = util::queue<tcp_connection*>;
         using connection_ptr_queue = util::queue<connection*>;
 
+        //stream frames go on the wire with their own mark
+        struct tcp_message
+        {
+            util::bytes data;
+            bool stream = false;
+        };
+        using tcp_message_queue = util::queue<tcp_message>;
+        using tcp_messages = std::vector<tcp_message>;
+
+        struct tcp_stream_frame
+        {
+            tcp_connection* from = nullptr;
+            util::bytes data;
+        };
+        using tcp_stream_queue = util::queue<tcp_stream_frame>;
+
+        //called on the io thread with each message or stream frame, in place of queueing it
+        using tcp_receive_handler = std::function<void(tcp_connection*, util::bytes&, bool stream)>;
+
+        //outgoing connection attempts
+        struct tcp_connect_stats
+        {
+            size_t attempts = 0; //connects started, retries included
+            size_t connected = 0;
+            size_t retried = 0;
+            size_t gave_up = 0; //ran out of retries
+            size_t connecting = 0; //waiting on a connect or a retry right now
+
+            tcp_connect_stats& operator+=(const tcp_connect_stats&);
+        };
+
         class tcp_connection : public connection
         {
             public:
@@ -57,13 +93,18 @@ namespace fire
                 tcp_connection(
                         boost::asio::io_service& io, 
                         byte_queue& in,
+                        tcp_stream_queue& in_streams,
                         tcp_connection_ptr_queue& last_in,
                         std::mutex& in_mutex,
+                        const tcp_receive_handler& receive,
                         bool track = false,
-                        bool con = false);
+                        bool con = false,
+                        bool no_delay = true);
                 ~tcp_connection();
             public:
                 virtual bool send(const fire::util::bytes& b, bool block = false);
+                virtual send_status try_send(const fire::util::bytes& b);
+                virtual bool send_stream(const fire::util::bytes& frame);
                 virtual endpoint get_endpoint() const;
                 virtual bool is_disconnected() const;
 
@@ -75,11 +116,14 @@ namespace fire
                 void reset_alive(); 
                 void bind(port_type port);
                 void connect(boost::asio::ip::tcp::endpoint);
+                void set_socket_options();
                 void start_read();
                 void close();
                 bool is_connected() const;
                 bool is_connecting() const;
                 con_state state() const;
+                tcp_connect_stats connect_stats() const;
+                size_t queued_bytes() const;
                 boost::asio::ip::tcp::socket& socket();
 
             public:
@@ -88,44 +132,105 @@ namespace fire
 
             private:
                 void do_close();
+                void start_connect(boost::asio::ip::tcp::endpoint);
+                void schedule_retry(boost::asio::ip::tcp::endpoint);
                 void handle_connect(
                         const boost::system::error_code& error, 
                         boost::asio::ip::tcp::endpoint e);
+                void handle_retry(
+                        const boost::system::error_code& error, 
+                        boost::asio::ip::tcp::endpoint e);
                 void handle_punch(const boost::system::error_code& error);
+                void queue_message(const tcp_message& m);
+                bool too_big(const util::bytes&) const;
                 void do_send(bool);
+                void requeue_unsent();
                 void handle_write(const boost::system::error_code& error, size_t);
                 void handle_header(const boost::system::error_code& error, size_t);
                 void handle_body(const boost::system::error_code& error, size_t, size_t);
+                void read_frame_header();
+                void handle_frame_header(const boost::system::error_code& error, size_t);
+                void handle_frame_body(const boost::system::error_code& error, size_t);
+                size_t take_buffered(char* dest, size_t size);
+                void deliver(util::bytes& data);
+                void reset_framing();
             private:
 
                 con_state _state;
                 boost::asio::io_service& _io;
                 byte_queue& _in_queue;
+                tcp_stream_queue& _in_streams;
                 std::mutex& _in_mutex;
-                byte_queue _out_queue;
+                const tcp_receive_handler& _receive;
+                tcp_message_queue _out_queue;
+                send_budget _budget; //bytes in _out_queue
                 tcp_connection_ptr_queue& _last_in_socket;
                 bool _track;
-                util::bytes _out_buffer;
+                util::bytes _out_buffer; //framing, and the bodies too for text frames
+                tcp_messages _out_messages; //being written
+                std::vector<boost::asio::const_buffer> _out_buffers;
                 endpoint _ep;
                 boost::asio::streambuf _in_buffer;
+                std::array<char, 5> _in_header; //binary frames
+                util::bytes _in_body;
                 tcp_socket_ptr _socket;
                 mutable std::mutex _mutex;
                 boost::system::error_code _error;
                 bool _writing;
+                bool _no_delay;
+                bool _in_stream = false; //message being read is a stream frame
+
+                //binary framing is offered by each side and used once the peer offers it too.
+                //each direction switches on its own, so old peers keep text frames
+                bool _offered = false;
+                bool _peer_binary = false;
+                bool _out_binary = false;
+                bool _in_binary = false;
                 int _retries;
+                boost::asio::steady_timer _retry_timer;
+                std::minstd_rand _jitter;
+                tcp_connect_stats _connect_stats;
                 bool _alive = false;
             private:
                 friend class tcp_queue;
-                friend void tcp_run_thread(tcp_queue*);
         };
 
         using tcp_connection_ptr = std::shared_ptr<tcp_connection>;
         using tcp_connections = std::vector<tcp_connection_ptr>;
 
+        //io_services shared by many tcp queues. each is run by one thread, 
+        //so the handlers of a connection never run at the same time
+        class tcp_service
+        {
+            public:
+                tcp_service(size_t threads = 1);
+                ~tcp_service();
+
+            public:
+                boost::asio::io_service& next();
+
+            private:
+                using work_guard = boost::asio::executor_work_guard<boost::asio::io_service::executor_type>;
+
+                std::vector<asio_service_ptr> _ios;
+                std::vector<work_guard> _work;
+                std::vector<util::thread_uptr> _threads;
+                std::mutex _mutex;
+                size_t _next = 0;
+        };
+
+        using tcp_service_ptr = std::shared_ptr<tcp_service>;
+
+        //runs f on the thread of io and waits for it to finish
+        void run_on_io(boost::asio::io_service& io, std::function<void()> f);
+
         class tcp_queue : public message_queue
         {
             public:
-                tcp_queue(const asio_params& p);
+                tcp_queue(
+                        const asio_params& p, 
+                        tcp_service_ptr service = {}, 
+                        tcp_receive_handler receive = {});
                 virtual ~tcp_queue();
 
             public:
@@ -133,45 +238,60 @@ namespace fire
                 virtual bool receive(util::bytes& b);
 
             public:
+                send_status try_send(const util::bytes& b);
+                bool send_stream(const util::bytes& frame);
+                bool receive_stream(tcp_stream_frame& f);
                 connection* get_socket() const;
                 void connect(const std::string& host, port_type port);
                 bool is_connected();
                 bool is_connecting();
                 bool is_disconnected();
+                tcp_connect_stats connect_stats() const;
+                size_t queued_bytes() const;
 
             private:
                 void connect();
                 void delayed_connect();
                 void accept();
+                void start_keep_alive();
+                void schedule_keep_alive();
+                void shutdown();
 
             private:
                 void handle_accept(tcp_connection_ptr nc, const boost::system::error_code& error);
+                void handle_keep_alive(const boost::system::error_code& error);
 
             private:
                 asio_params _p;
-                asio_service_ptr _io;
+                tcp_service_ptr _service;
+                tcp_receive_handler _receive; //when set, messages skip _in_queue and _in_streams
+                boost::asio::io_service& _io;
                 tcp_resolver_ptr _resolver;
                 tcp_acceptor_ptr _acceptor;
-                util::thread_uptr _run_thread;
-                util::thread_uptr _keep_alive_thread;
+                boost::asio::steady_timer _keep_alive_timer;
+                bool _keep_alive_armed = false;
 
                 tcp_connection_ptr _out;
                 mutable tcp_connection_ptr_queue _last_in_socket;
                 tcp_connections _in_connections;
                 byte_queue _in_queue;
+                tcp_stream_queue _in_streams;
                 mutable std::mutex _mutex;
 
                 bool _done;
-
-            private:
-                friend void tcp_run_thread(tcp_queue*);
-                friend void keep_alive_thread(tcp_queue*);
         };
 
         using tcp_queue_ptr = std::shared_ptr<tcp_queue>;
 
-        tcp_queue_ptr create_tcp_queue(const address_components& c);
-        tcp_queue_ptr create_tcp_queue(const std::string& address, const queue_options& defaults);
+        tcp_queue_ptr create_tcp_queue(
+                const address_components& c, 
+                tcp_service_ptr service = {}, 
+                tcp_receive_handler receive = {});
+        tcp_queue_ptr create_tcp_queue(
+                const std::string& address, 
+                const queue_options& defaults, 
+                tcp_service_ptr service = {},
+                tcp_receive_handler receive = {});
     }
 }
 
@@ -38,9 +38,24 @@
 
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
 #include <functional>
+#include <limits>
 #include <boost/bind.hpp>
 
+#ifdef FIRESTR_UDP_MMSG
+#include <array>
+#include <cerrno>
+#endif
+
+#if defined(FIRESTR_UDP_MMSG) || defined(FIRESTR_UDP_REUSEPORT)
+#include <sys/socket.h>
+#endif
+
+#ifdef __linux__
+#include <netinet/in.h>
+#endif
+
 namespace u = fire::util;
 namespace ba = boost::asio;
 using namespace boost::asio::ip;
@@ -51,89 +66,403 @@ namespace fire
     {
         namespace
         {
-            const size_t MAX_FLIGHT = 4;
-            const size_t BLOCK_SLEEP = 10;
+            const size_t MAX_QUEUED = 4; //unreliable chunks queued per message
+            const double INITIAL_WINDOW = 4; //in chunks
+            const double MIN_WINDOW = 2;
+            const double MAX_WINDOW = 4096;
+            const size_t SEND_BUDGET = 16 * 1024 * 1024; //bytes of messages queued before senders wait
             const size_t THREAD_SLEEP = 40;
-            const size_t RESEND_THREAD_SLEEP = 1000;
-            const size_t RESEND_TICK_THRESHOLD = 1; //resend after 1 seconds
-            const size_t RESEND_THRESHOLD = 5; //purge message after 5 seconds
-            const size_t UDP_PACKET_SIZE = 512; //in bytes
-            const size_t MAX_UDP_BUFF_SIZE = UDP_PACKET_SIZE*2; 
+            const double INITIAL_RTO = 1000; //in milliseconds, until there is an rtt sample
+            const double MIN_RTO = 200;
+            const double MAX_RTO = 4000;
+            const double RTO_GRANULARITY = 10;
+            const double PACING_GAIN = 1.25; //pace a little faster than the window drains so it can grow
+            const double STARTUP_PACING_GAIN = 2; //slow start doubles the window every round trip
+            const size_t PACING_BURST = 4; //packets that may leave back to back
+            const double PACING_INTERVAL = 1; //in milliseconds, buckets hold at least this much sending
+            const size_t FAST_RESEND_THRESHOLD = 3; //resend after 3 later chunks are acked
+            const size_t MAX_FAST_SCAN = 32; //unacked chunks checked per ack
+            const auto MESSAGE_TIMEOUT = std::chrono::seconds(5); //purge message after 5 seconds without an ack
+            const size_t ACK_EVERY = 16; //received chunks acked together
+            const auto ACK_DELAY = std::chrono::milliseconds(5); //max time an ack is held back
+            const size_t MAX_COMPLETED = 4096; //delivered messages remembered to drop duplicates
+            const size_t UDP_PACKET_SIZE = 512; //in bytes, used until the path mtu is known
+            const size_t MAX_PACKET_SIZE = 1472; //ethernet mtu minus ip and udp headers
+            const size_t MAX_UDP_BUFF_SIZE = MAX_PACKET_SIZE*2; 
             const size_t SEQUENCE_BASE = 1;
             const size_t CHUNK_TOTAL_BASE = SEQUENCE_BASE + sizeof(sequence_type);
             const size_t CHUNK_BASE = CHUNK_TOTAL_BASE + sizeof(chunk_total_type);
-            const size_t MESSAGE_BASE = CHUNK_BASE + sizeof(chunk_id_type);
+            const size_t CHUNK_SIZE_BASE = CHUNK_BASE + sizeof(chunk_id_type);
+            const size_t FEC_BASE = CHUNK_SIZE_BASE + sizeof(chunk_size_type);
+            const size_t MESSAGE_BASE = FEC_BASE + sizeof(fec_type);
 
-            //<mark> <sequence num> <message_chunk total> <message_chunk>
+            //<mark> <sequence num> <message_chunk total> <message_chunk> <chunk size> <fec group>
             const size_t HEADER_SIZE = MESSAGE_BASE;
+
+            //<mark> <sequence num> <message_chunk total> <message_chunk>
+            //older peers only read this one, with every chunk but the last a fixed size
+            const size_t LEGACY_HEADER_SIZE = CHUNK_SIZE_BASE;
+            const size_t LEGACY_CHUNK_SIZE = UDP_PACKET_SIZE - LEGACY_HEADER_SIZE;
             const size_t UDP_CHuNK_SIZE = UDP_PACKET_SIZE - HEADER_SIZE; //in bytes
+            const size_t MAX_CHUNK_SIZE = MAX_PACKET_SIZE - HEADER_SIZE;
+
+            //parity chunks carry the size of the last chunk in their group after the xor,
+            //so data chunks shrink by that much to keep parity within the packet size
+            const size_t FEC_TRAILER_SIZE = sizeof(chunk_size_type);
+            const size_t MIN_CHUNK_SIZE = UDP_CHuNK_SIZE - FEC_TRAILER_SIZE;
+            const size_t MAX_FEC = std::numeric_limits<fec_type>::max();
+
+            //packet sizes probed from largest to smallest. 
+            //ethernet, pppoe, common vpn/tunnel, ipv6 minimum, and a safe floor.
+            const size_t PROBE_SIZES[] = {1472, 1464, 1400, 1232, 1024};
+            const size_t PROBE_RUNGS = sizeof(PROBE_SIZES) / sizeof(PROBE_SIZES[0]);
+            const size_t PROBE_TRIES = 2; //probes sent per size before stepping down
+            const size_t BLACK_HOLE_TIMEOUTS = 3; //timeouts in a row before dropping to UDP_PACKET_SIZE
 
             const size_t MAX_CHUNKS = std::pow(2,sizeof(chunk_total_type)*8);
-            const size_t MAX_MESSAGE_SIZE = MAX_CHUNKS * UDP_CHuNK_SIZE;
+            const size_t MAX_MESSAGE_CHUNKS = MAX_CHUNKS - 1; //largest total the header can carry
+
+            //chunks are never smaller than the packet size used before the path mtu
+            //is known, less the parity trailer, so a message within these fits any path
+            const size_t MAX_MESSAGE_SIZE = MAX_MESSAGE_CHUNKS * UDP_CHuNK_SIZE;
+            const size_t MAX_FEC_MESSAGE_SIZE = MAX_MESSAGE_CHUNKS * MIN_CHUNK_SIZE;
+
+            //a peer can hold one message of the largest size. parity that 
+            //would not fit with it is left off when sending
+            const size_t PEER_REASSEMBLY_QUOTA = MAX_MESSAGE_SIZE + MAX_CHUNK_SIZE;
+            const auto REASSEMBLY_TIMEOUT = std::chrono::seconds(10); //partial message dropped after no chunk for this long
+
+            //bytes each priority class may send per round. realtime, interactive, bulk
+            const long CLASS_QUANTUM[PRIORITY_CLASSES] = {8 * MAX_PACKET_SIZE, 4 * MAX_PACKET_SIZE, MAX_PACKET_SIZE};
+            const long FLOW_QUANTUM = MAX_PACKET_SIZE; //bytes each peer in a class may send per round
+
+            //max datagrams moved per sendmmsg/recvmmsg call
+            const size_t MAX_BATCH = 64;
+
+            const size_t MAX_SHARDS = 64;
+
+            const auto STATS_INTERVAL = std::chrono::milliseconds(500); //between per peer snapshots
+            const double STATS_GAIN = 0.25; //weight of the newest interval in averages
+            const size_t STATS_IDLE = 120; //snapshots without traffic before a peer is forgotten
+            const size_t MAX_TELEMETRY_PEERS = 1024;
+            const auto PEER_IDLE = std::chrono::seconds(60); //congestion state kept for a quiet peer
+            const size_t MAX_PEERS = 1024; //past this the longest idle peers are forgotten early
+        }
+
+        size_t udp_endpoint_hash::operator()(const udp::endpoint& e) const
+        {
+            const auto& a = e.address();
+            size_t h = a.is_v4() ? 
+                a.to_v4().to_ulong() : 
+                std::hash<std::string>{}(a.to_string());
+            return (h << 16) ^ e.port();
+        }
+
+        size_t peer_sequence_hash::operator()(const peer_sequence& s) const
+        {
+            return udp_endpoint_hash{}(s.ep) ^ std::hash<sequence_type>{}(s.sequence);
+        }
+
+        udp_peer_stats& udp_peer_stats::operator+=(const udp_peer_stats& o)
+        {
+            //a peer can show up on more than one shard, 
+            //only the one sending to it has rtt and window
+            srtt = std::max(srtt, o.srtt);
+            if(min_rtt == 0 || (o.min_rtt > 0 && o.min_rtt < min_rtt)) min_rtt = o.min_rtt;
+            loss = std::max(loss, o.loss);
+            resent += o.resent;
+            duplicates += o.duplicates;
+            in_flight += o.in_flight;
+            window = std::max(window, o.window);
+            reassembly_bytes += o.reassembly_bytes;
+            send_rate += o.send_rate;
+            recv_rate += o.recv_rate;
+            return *this;
+        }
+
+        double udp_stats::packets_per_send() const
+        {
+            return send_calls > 0 ? static_cast<double>(packets_sent) / send_calls : 0.0;
+        }
+
+        double udp_stats::packets_per_recv() const
+        {
+            return recv_calls > 0 ? static_cast<double>(packets_recv) / recv_calls : 0.0;
+        }
+
+        udp_stats& udp_stats::operator+=(const udp_stats& o)
+        {
+            dropped += o.dropped;
+            rebuilt += o.rebuilt;
+            reassembly_bytes += o.reassembly_bytes;
+            evicted_stale += o.evicted_stale;
+            evicted_full += o.evicted_full;
+            bytes_sent += o.bytes_sent;
+            bytes_recv += o.bytes_recv;
+            packets_sent += o.packets_sent;
+            packets_recv += o.packets_recv;
+            send_calls += o.send_calls;
+            recv_calls += o.recv_calls;
+            for(const auto& p : o.peers) peers[p.first] += p.second;
+            return *this;
         }
 
-        udp_queue_ptr create_udp_queue(const asio_params& p)
+        udp_queue_ptr create_udp_queue(const asio_params& p, receive_handler receive)
         {
-            return udp_queue_ptr{new udp_queue{p}};
+            return udp_queue_ptr{new udp_queue{p, receive}};
         }
 
         udp_connection::udp_connection(
                 endpoint_queue& in,
-                boost::asio::io_service& io) :
+                boost::asio::io_service& io,
+                size_t shard,
+                const udp_connections* shards,
+                size_t upload_rate,
+                size_t reassembly_budget,
+                bool uring,
+                receive_handler receive) :
             _in_buffer(MAX_UDP_BUFF_SIZE),
+            _in_budget{reassembly_budget > 0 ? reassembly_budget : PEER_REASSEMBLY_QUOTA},
+            _in_peer_quota{std::min(_in_budget, PEER_REASSEMBLY_QUOTA)},
             _in_queue(in),
+            _receive{receive},
+            _budget{SEND_BUDGET},
+            _resend_timer{io},
+            _ack_timer{io},
+            _pace_timer{io},
+            _probe_timer{io},
+            _stats_timer{io},
+            _shard{shard},
+            _shards{shards},
             _io(io),
             _socket{new udp::socket{io}},
             _writing{false}
         {
+            REQUIRE(!shards || shard < shards->size());
+
+#ifdef FIRESTR_UDP_URING
+            _use_ring = uring;
+#endif
+
+            //each shard hands out ids from its own residue class
+            _sequence = shard;
+            _probe_id = shard;
+
+            //upload cap in bytes per millisecond
+            _upload.rate = upload_rate / 1000.0;
+            _upload.burst = std::max(PACING_BURST * MAX_PACKET_SIZE * 1.0, _upload.rate * PACING_INTERVAL);
+
             boost::system::error_code error;
             _socket->open(udp::v4(), error);
 
+#ifdef FIRESTR_UDP_MMSG
+            _out_batch.data.resize(MAX_BATCH);
+            _out_batch.eps.resize(MAX_BATCH);
+            _in_batch.data.resize(MAX_BATCH, u::bytes(MAX_UDP_BUFF_SIZE));
+            _in_batch.eps.resize(MAX_BATCH);
+#endif
+
             INVARIANT(_socket);
         }
 
         void udp_connection::close()
         {
+            _budget.close();
             _io.post(boost::bind(&udp_connection::do_close, this));
         }
 
         void udp_connection::do_close()
         {
             INVARIANT(_socket);
+            _resend_timer.cancel();
+            _ack_timer.cancel();
+            _pace_timer.cancel();
+            _probe_timer.cancel();
+            _stats_timer.cancel();
+#ifdef FIRESTR_UDP_URING
+            _ring.reset();
+#endif
             _socket->close();
             _writing = false;
         }
 
-        void udp_connection::init_working(message_chunk& proto, util::bytes& data)
+        message_ring_item& message_ring::add(sequence_type s)
+        {
+            REQUIRE(_index.find(s) == _index.end());
+
+            //reuse a free slot before growing
+            size_t i = 0;
+            if(!_free.empty())
+            {
+                i = _free.back();
+                _free.pop_back();
+            }
+            else
+            {
+                i = _slots.size();
+                _slots.emplace_back();
+                _slots.back().handle.slot = i;
+            }
+
+            auto& r = _slots[i];
+            CHECK_FALSE(r.used);
+            r.used = true;
+
+            _size++;
+            _index[s] = r.handle;
+
+            ENSURE(r.used);
+            ENSURE_EQUAL(r.handle.slot, i);
+            return r;
+        }
+
+        void message_ring::remove(message_ring_item& r)
+        {
+            REQUIRE(r.used);
+            REQUIRE_GREATER(_size, 0);
+
+            const size_t i = r.handle.slot;
+            CHECK_EQUAL(&_slots[i], &r);
+
+            _index.erase(r.wm.proto.sequence);
+            _size--;
+
+            //old handles no longer match
+            r.used = false;
+            r.handle.generation++;
+            r.wm = working_message{};
+            r.resends.clear();
+            _free.push_back(i);
+        }
+
+        message_ring_item* message_ring::find(sequence_type s)
+        {
+            auto h = _index.find(s);
+            return h != _index.end() ? get(h->second) : nullptr;
+        }
+
+        message_ring_item* message_ring::get(const message_handle& h)
+        {
+            if(h.slot >= _slots.size()) return nullptr;
+
+            auto& r = _slots[h.slot];
+            return r.used && r.handle.generation == h.generation ? &r : nullptr;
+        }
+
+        bool message_ring::empty() const
+        {
+            return _size == 0;
+        }
+
+        size_t message_ring::size() const
+        {
+            return _size;
+        }
+
+        size_t parity_groups(size_t total, size_t fec)
+        {
+            return fec > 0 ? (total + fec - 1) / fec : 0;
+        }
+
+        size_t parity_size(const message_chunk& proto)
+        {
+            return proto.chunk_size + FEC_TRAILER_SIZE;
+        }
+
+        void write_be_u16(u::bytes& b, size_t offset, uint16_t v);
+        void make_parity(working_message& wm)
+        {
+            const size_t total = wm.proto.total_chunks;
+            const size_t fec = wm.proto.fec;
+            const size_t groups = parity_groups(total, fec);
+            if(groups == 0) return;
+
+            const size_t chunk_size = wm.proto.chunk_size;
+            const size_t psize = parity_size(wm.proto);
+            wm.parity.assign(groups * psize, 0);
+
+            //xor each chunk into its group, short chunks are zero padded
+            for(size_t n = 0; n < total; n++)
+            {
+                const size_t g = n / fec;
+                const size_t start = n * chunk_size;
+                const size_t end = std::min(wm.data.size(), start + chunk_size);
+
+                char* p = wm.parity.data() + g * psize;
+                const char* d = wm.data.data() + start;
+                for(size_t i = 0; i < end - start; i++) p[i] ^= d[i];
+
+                //last chunk in group records its size
+                if(n + 1 == total || (n + 1) % fec == 0)
+                    write_be_u16(wm.parity, g * psize + chunk_size, end - start);
+            }
+        }
+
+        void udp_connection::init_working(
+                message_chunk& proto, 
+                util::bytes& data, 
+                endpoint_message::priority_class priority)
         {
             REQUIRE_GREATER(proto.total_chunks, 0);
+            REQUIRE_GREATER(proto.chunk_size, 0);
+            REQUIRE_RANGE(priority, 0, PRIORITY_CLASSES);
 
-            //add to working map
-            auto& wm = _out_working[proto.sequence];
+            //add to the ring of messages being sent
+            auto& r = _message_ring.add(proto.sequence);
+            auto& wm = r.wm;
 
             wm.proto = std::move(proto);
+            wm.ep = wm.proto.ep;
             wm.data = std::move(data);
             wm.set.resize(proto.total_chunks);
             wm.sent.resize(proto.total_chunks);
 
-            message_ring_item ri = { &wm,  chunk_id_queue()};
-            _message_ring.emplace_back(ri);
+            if(wm.proto.type == message_chunk::msg)
+            {
+                wm.sent_at.resize(proto.total_chunks);
+                wm.deadline.resize(proto.total_chunks);
+                wm.skipped.resize(proto.total_chunks);
+                wm.resent.resize(proto.total_chunks);
+                wm.last_progress = udp_clock::now();
+            }
+
+            make_parity(wm);
+
+            //join the flow for the peer in its class, the flow is last in the round if new
+            auto& k = _classes[priority];
+            auto f = k.index.find(wm.ep);
+            if(f == k.index.end())
+            {
+                k.flows.push_back({wm.ep, {}, FLOW_QUANTUM});
+                f = k.index.emplace(wm.ep, std::prev(k.flows.end())).first;
+            }
+            f->second->messages.push_back(r.handle);
         }
 
-        void udp_connection::cleanup_message(sequence_type s)
+        void udp_connection::cleanup_message(message_ring_item& r)
         {
-            //cleanup ring buffer
-            auto ring_iter = std::find_if(_message_ring.begin(), _message_ring.end(), 
-                    [s](const message_ring_item& i){ return i.wm->proto.sequence == s;});
-            CHECK(ring_iter != _message_ring.end());
+            //chunks never acked no longer count against the peer window
+            auto& wm = r.wm;
+            if(wm.in_flight > 0)
+            {
+                auto& p = peer(wm.ep);
+                p.in_flight -= std::min(p.in_flight, wm.in_flight);
+            }
 
-            _message_ring.erase(ring_iter);
-            _out_working.erase(s);
+            //let waiting senders in
+            _budget.give_back(wm.data.size());
+            _message_ring.remove(r);
         }
 
         bool all_sent(working_message& wm)
         {
-            return wm.sent.count() == wm.proto.total_chunks;
+            return wm.sent.count() == wm.proto.total_chunks && 
+                wm.next_parity == parity_groups(wm.proto.total_chunks, wm.proto.fec);
+        }
+
+        udp_time after(udp_time now, double ms)
+        {
+            return now + std::chrono::microseconds{static_cast<int64_t>(ms * 1000)};
         }
 
         void udp_connection::sent_chunk(const message_chunk& c)
@@ -141,258 +470,1106 @@ namespace fire
             REQUIRE(c.type != message_chunk::ack);
             REQUIRE_FALSE(c.resent);
 
-            auto& wm = _out_working[c.sequence];
-            wm.sent[c.chunk] = 1;
+            //message may have been purged while the chunk was queued
+            auto r = _message_ring.find(c.sequence);
+            if(!r) return;
+
+            auto& wm = r->wm;
             if(wm.queued > 0) wm.queued--;
 
+            //parity is fire and forget, it is never acked or resent
+            if(c.chunk >= wm.proto.total_chunks)
+            {
+                if(wm.proto.type == message_chunk::qmsg && all_sent(wm)) cleanup_message(*r);
+                return;
+            }
+
+            wm.sent[c.chunk] = 1;
+
             bool robust = wm.proto.type == message_chunk::msg;
-            if(robust) wm.in_flight++;
-            else if(all_sent(wm)) cleanup_message(c.sequence);
+            if(robust) 
+            {
+                wm.in_flight++;
+                peer(wm.ep).in_flight++;
+                telemetry(wm.ep).chunks_sent++;
+
+                const auto now = udp_clock::now();
+                wm.sent_at[c.chunk] = now;
+                wm.last_progress = now;
+                arm_resend(*r, c.chunk, after(now, peer(wm.ep).rto));
+            }
+            else if(all_sent(wm)) cleanup_message(*r);
         }
 
-        void udp_connection::validate_chunk(const message_chunk& c)
+        void udp_connection::resent_chunk(const message_chunk& c)
         {
-            REQUIRE(c.type == message_chunk::ack);
+            REQUIRE(c.resent);
 
-            auto& w = _out_working;
+            auto r = _message_ring.find(c.sequence);
+            if(!r) return;
 
-            auto chunk_n = c.chunk;
-            auto sequence_n = c.sequence;
+            auto& wm = r->wm;
+            if(wm.proto.type != message_chunk::msg) return;
 
-            auto wmi = w.find(sequence_n);
-            if(wmi == w.end()) return;
+            auto& t = telemetry(wm.ep);
+            t.chunks_sent++;
+            t.resent++;
 
-            auto& wm = wmi->second;
+            //resent chunks do not give rtt samples
+            wm.resent[c.chunk] = 1;
+            arm_resend(*r, c.chunk, after(udp_clock::now(), peer(wm.ep).rto));
+        }
 
-            if(chunk_n >= wm.proto.total_chunks) return;
-            if(c.total_chunks != wm.proto.total_chunks) return;
-            if(wm.set[chunk_n]) return;
+        void udp_connection::arm_resend(message_ring_item& r, chunk_id_type c, udp_time deadline)
+        {
+            REQUIRE(r.used);
+            REQUIRE_LESS(c, r.wm.deadline.size());
 
-            wm.set[chunk_n] = 1;
-            wm.ticks = 0;
-            if(wm.in_flight > 0 ) wm.in_flight--;
+            r.wm.deadline[c] = deadline;
+            _resend_timeouts.push({deadline, r.handle, c});
+            schedule_resend();
+        }
 
-            //if message is not complete yet, return 
-            if(wm.set.count() != wm.proto.total_chunks) return;
+        void udp_connection::schedule_resend()
+        {
+            if(_resend_timeouts.empty()) return;
 
-            CHECK_EQUAL(wm.sent.count(), wm.proto.total_chunks);
-            CHECK_EQUAL(wm.in_flight, 0);
-            CHECK_EQUAL(wm.queued, 0);
+            const auto next = _resend_timeouts.top().deadline;
+            if(_resend_timer_armed && _resend_timer_deadline <= next) return;
 
-            //remove message from working
-            cleanup_message(sequence_n);
+            _resend_timer_armed = true;
+            _resend_timer_deadline = next;
+            _resend_timer.expires_at(next);
+            _resend_timer.async_wait(
+                    boost::bind(&udp_connection::handle_resend_timer, this, ba::placeholders::error));
         }
 
-        void udp_connection::send_right_away(message_chunk& c)
+        void udp_connection::handle_resend_timer(const boost::system::error_code& error)
         {
-            _out_queue.emplace_push(c);
-            post_send();
-        }
+            //timer was moved to an earlier deadline or closed
+            if(error == ba::error::operation_aborted) return;
+            _resend_timer_armed = false;
 
+            const auto now = udp_clock::now();
 
-        message_chunk nth_chunk(size_t n, const message_chunk& prototype, const util::bytes& data)
-        {
-            REQUIRE_LESS(n, prototype.total_chunks);
-
-            size_t start = n * UDP_CHuNK_SIZE;
-            size_t end = std::min(data.size(), start + UDP_CHuNK_SIZE);
-            size_t size = end - start; 
+            //chunks resent per peer this round
+            std::unordered_map<udp_peer*, size_t> resends;
 
-            CHECK_GREATER(size, 0);
+            bool resent = false;
+            std::vector<resend_timeout> later;
+            while(!_resend_timeouts.empty() && _resend_timeouts.top().deadline <= now)
+            {
+                auto t = _resend_timeouts.top();
+                _resend_timeouts.pop();
 
-            message_chunk c = prototype;
-            c.chunk = n;
-            c.write_size = size;
-            c.write_data = data.data() + start;
+                //skip if acked, purged or rearmed since
+                auto r = _message_ring.get(t.message);
+                if(!r) continue;
 
-            ENSURE_EQUAL(c.chunk, n);
-            ENSURE(c.write_data);
-            ENSURE_GREATER(c.write_size, 0);
-            return c;
-        }
+                auto& wm = r->wm;
+                if(wm.set[t.chunk] || wm.deadline[t.chunk] != t.deadline) continue;
 
-        bool udp_connection::get_next_chunk(working_message& wm, message_chunk& queued_chunk)
-        {
-            REQUIRE_GREATER(wm.proto.total_chunks, 0);
-            bool robust = wm.proto.type == message_chunk::msg;
+                //peer has not acked anything in a while, give up on the message
+                if(now - wm.last_progress > MESSAGE_TIMEOUT)
+                {
+                    cleanup_message(*r);
+                    continue;
+                }
 
-            auto in_flight = robust ? wm.in_flight : 0;
+                auto& p = peer(wm.ep);
+                window_lost(p, true);
 
-            if(in_flight + wm.queued > MAX_FLIGHT) return false;
+                //resend no more than a window worth at once, 
+                //the rest waits about a round trip
+                auto& n = resends[&p];
+                if(n >= static_cast<size_t>(p.window))
+                {
+                    t.deadline = after(now, p.has_rtt ? p.srtt : p.rto);
+                    later.push_back(t);
+                    continue;
+                }
+                n++;
 
-            auto t = MAX_FLIGHT - (in_flight + wm.queued);
-            CHECK_GREATER_EQUAL(t, 0);
-            if(t == 0 || wm.next_send >= wm.proto.total_chunks) 
-                return false;
+                _stats.dropped++;
+                telemetry(wm.ep).lost++;
+                wm.deadline[t.chunk] = udp_time{};
+                queue_resend(*r, t.chunk);
+                resent = true;
+            }
 
-            queued_chunk = nth_chunk(wm.next_send, wm.proto, wm.data);
+            //messages may have been purged later in the round
+            for(const auto& t : later)
+            {
+                auto r = _message_ring.get(t.message);
+                if(r) arm_resend(*r, t.chunk, t.deadline);
+            }
 
-            wm.next_send++;
-            wm.queued++;
-            return true;
+            schedule_resend();
+            if(resent) post_send();
         }
 
-        void udp_connection::queue_resend(message_ring_item& r, chunk_id_type nth)
+        void udp_connection::fast_resend(message_ring_item& r, chunk_id_type acked)
         {
-            r.resends.emplace_push(nth);
-            post_send();
+            auto& wm = r.wm;
+            REQUIRE(wm.proto.type == message_chunk::msg);
+
+            //chunks sent before the acked one that are still not acked 
+            //are likely lost, resend them without waiting for the timer
+            size_t scanned = 0;
+            for(size_t c = wm.lowest_unacked; c < acked && scanned < MAX_FAST_SCAN; c++)
+            {
+                if(wm.set[c] || !wm.sent[c]) continue;
+                scanned++;
+
+                if(wm.skipped[c] >= FAST_RESEND_THRESHOLD) continue;
+                wm.skipped[c]++;
+                if(wm.skipped[c] < FAST_RESEND_THRESHOLD || wm.resent[c]) continue;
+
+                window_lost(peer(wm.ep), false);
+
+                _stats.dropped++;
+                telemetry(wm.ep).lost++;
+                queue_resend(r, c);
+            }
+
+            while(wm.lowest_unacked < wm.proto.total_chunks && wm.set[wm.lowest_unacked]) 
+                wm.lowest_unacked++;
         }
 
-        bool udp_connection::incr_next_message()
+        udp_peer& udp_connection::peer(const udp::endpoint& ep)
         {
-            if(_message_ring.empty())
+            u::mutex_scoped_lock l(_peer_mutex);
+            auto i = _peers.find(ep);
+            if(i != _peers.end()) 
             {
-                _next_message = 0;
-                return false;
+                i->second.used = udp_clock::now();
+                return i->second;
             }
 
-            //if at end, go to beginning
-            _next_message = (_next_message + 1) % _message_ring.size();
-            ENSURE_RANGE(_next_message, 0, _message_ring.size());
-            return true;
+            auto& p = _peers[ep];
+            p.window = INITIAL_WINDOW;
+            p.threshold = MAX_WINDOW;
+            p.rto = INITIAL_RTO;
+            p.packet_size = UDP_PACKET_SIZE;
+            p.used = udp_clock::now();
+            return p;
         }
 
-        using exhausted_messages = std::vector<sequence_type>;
+        udp_peer* udp_connection::find_peer(const udp::endpoint& ep)
+        {
+            u::mutex_scoped_lock l(_peer_mutex);
+            auto i = _peers.find(ep);
+            return i != _peers.end() ? &i->second : nullptr;
+        }
 
-        void udp_connection::queue_next_chunk()
+        void udp_connection::forget_idle_peers(udp_time now)
         {
-            //do round robin
-            if(!incr_next_message()) return;
-            auto end = _next_message;
+            //peers with chunks in flight or a probe out are still in use
+            auto idle = [](const udp_peer& p) { return p.in_flight == 0 && p.probe != udp_peer::probing;};
 
-            message_chunk c;
-            chunk_id_type resend_id;
-            do
-            {
-                auto& r = _message_ring[_next_message];
-                CHECK(r.wm != nullptr);
-                auto& wm = *r.wm;
-                if(get_next_chunk(wm, c))
-                {
-                    _out_queue.emplace_push(c);
-                    break;
-                }
-                //check to see if there are resends
-                else if(r.resends.pop(resend_id))
-                {
-                    message_chunk mc = nth_chunk(resend_id, wm.proto, wm.data);
-                    mc.resent = true;
-                    _out_queue.emplace_push(mc);
-                    break;
-                }
-                incr_next_message();
-            }
-            while(_next_message != end);
+            u::mutex_scoped_lock l(_peer_mutex);
+            for(auto i = _peers.begin(); i != _peers.end();)
+                if(idle(i->second) && now - i->second.used > PEER_IDLE) i = _peers.erase(i);
+                else ++i;
+
+            if(_peers.size() <= MAX_PEERS) return;
+
+            //too many to wait for, forget the longest idle first
+            std::vector<std::pair<udp_time, udp::endpoint>> oldest;
+            for(const auto& i : _peers)
+                if(idle(i.second)) oldest.emplace_back(i.second.used, i.first);
+
+            const size_t extra = std::min(_peers.size() - MAX_PEERS, oldest.size());
+            std::nth_element(oldest.begin(), oldest.begin() + extra, oldest.end(), 
+                    [](const std::pair<udp_time, udp::endpoint>& a, const std::pair<udp_time, udp::endpoint>& b) 
+                    { return a.first < b.first;});
+
+            for(size_t n = 0; n < extra; n++) _peers.erase(oldest[n].second);
         }
 
-        chunk_total_type total_chunks(size_t data_size)
+        void pace(udp_peer& p)
         {
-            REQUIRE_GREATER(data_size, 0);
-
-            chunk_total_type r = (data_size / UDP_CHuNK_SIZE);
-            if(data_size % UDP_CHuNK_SIZE) r += 1;
+            //about a window every round trip. without an rtt there is nothing to go on
+            if(!p.has_rtt || p.srtt <= 0) 
+            {
+                p.pace.rate = 0;
+                return;
+            }
 
-            ENSURE_GREATER(r, 0);
-            return r;
+            const double gain = p.window < p.threshold ? STARTUP_PACING_GAIN : PACING_GAIN;
+            p.pace.rate = gain * p.window * p.packet_size / p.srtt;
+            p.pace.burst = std::max(PACING_BURST * p.packet_size * 1.0, p.pace.rate * PACING_INTERVAL);
         }
 
-        message_chunk create_prototype(sequence_type sequence, const endpoint_message& m)
+        void refill(token_bucket& b, udp_time now)
         {
-            message_chunk c;
-            c.valid = true;
-            c.type = m.robust ? message_chunk::msg : message_chunk::qmsg;
-            c.host = m.ep.address;
-            c.port = m.ep.port;
-            c.sequence = sequence;
-            c.total_chunks = total_chunks(m.data.size());
-            c.chunk = 0;
+            if(b.rate <= 0) return;
 
-            return c;
+            const std::chrono::duration<double, std::milli> elapsed = now - b.filled;
+            b.tokens = std::min(b.burst, b.tokens + elapsed.count() * b.rate);
+            b.filled = now;
         }
 
-        void udp_connection::post_send()
+        void spend(token_bucket& b, size_t bytes)
         {
-            _io.post(boost::bind(&udp_connection::do_send, this));
+            //may go into debt by one packet
+            if(b.rate > 0) b.tokens -= bytes;
         }
 
-        void udp_connection::add_to_working_set(endpoint_message m)
+        void udp_connection::window_acked(udp_peer& p)
         {
-            REQUIRE_FALSE(m.data.empty());
+            u::mutex_scoped_lock l(_peer_mutex);
 
-            //update sequence
-            _sequence++;
+            p.timeouts = 0;
+
+            //slow start until the threshold, then additive increase
+            if(p.window < p.threshold) p.window += 1;
+            else p.window += 1 / p.window;
 
-            message_chunk proto = create_prototype(_sequence, m);
-            init_working(proto, m.data);
+            p.window = std::min(p.window, MAX_WINDOW);
+            pace(p);
         }
 
-        bool udp_connection::send(const endpoint_message& m, bool block)
+        void udp_connection::window_lost(udp_peer& p, bool timeout)
         {
-            INVARIANT(_socket);
-            if(m.data.empty()) return false;
-            if(m.data.size() > MAX_MESSAGE_SIZE)
+            u::mutex_scoped_lock l(_peer_mutex);
+
+            //decrease once per round trip, or per timeout period, 
+            //no matter how many chunks were lost
+            const auto now = udp_clock::now();
+            if(now < p.recover_until) return;
+
+            const auto wait = timeout || !p.has_rtt ? p.rto : p.srtt;
+            p.recover_until = now + std::chrono::microseconds{static_cast<int64_t>(wait * 1000)};
+
+            //a timeout means the pipe drained, start over from slow start
+            p.threshold = std::max(p.window / 2, MIN_WINDOW);
+            p.window = timeout ? MIN_WINDOW : p.threshold;
+
+            if(timeout) p.rto = std::min(p.rto * 2, MAX_RTO);
+
+            //large packets may be silently dropped on the path, 
+            //fall back to the smallest size and probe again
+            if(timeout && ++p.timeouts >= BLACK_HOLE_TIMEOUTS && p.packet_size > UDP_PACKET_SIZE)
             {
-                LOG << "message of size `" << m.data.size() << "' is larger than the max message size of `" << MAX_MESSAGE_SIZE << "'" << std::endl;
-                return false;
+                LOG << "udp path mtu black hole, falling back to " << UDP_PACKET_SIZE << " byte packets" << std::endl;
+                p.packet_size = UDP_PACKET_SIZE;
+                p.probe = udp_peer::unprobed;
+                p.timeouts = 0;
             }
 
-            _io.post(boost::bind(&udp_connection::add_to_working_set, this, m));
-            _io.post(boost::bind(&udp_connection::do_send, this));
+            pace(p);
+            ENSURE_GREATER_EQUAL(p.window, MIN_WINDOW);
+        }
 
-            //if we are blocking, block until all messages are sent
-            while(block && !_out_queue.empty()) u::sleep_thread(BLOCK_SLEEP);
+        void udp_connection::update_rtt(udp_peer& p, double r)
+        {
+            REQUIRE_GREATER_EQUAL(r, 0);
+            u::mutex_scoped_lock l(_peer_mutex);
 
-            return true;
+            //RFC 6298
+            if(!p.has_rtt)
+            {
+                p.srtt = r;
+                p.rttvar = r / 2;
+                p.has_rtt = true;
+            }
+            else
+            {
+                p.rttvar = 0.75 * p.rttvar + 0.25 * std::abs(p.srtt - r);
+                p.srtt = 0.875 * p.srtt + 0.125 * r;
+            }
+
+            if(p.min_rtt == 0 || r < p.min_rtt) p.min_rtt = r;
+
+            p.rto = p.srtt + std::max(RTO_GRANULARITY, 4 * p.rttvar);
+            p.rto = std::min(std::max(p.rto, MIN_RTO), MAX_RTO);
+            pace(p);
         }
 
-        void write_be_u64(u::bytes& b, size_t offset, uint64_t v)
+        peer_windows udp_connection::windows() const
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint64_t));
+            u::mutex_scoped_lock l(_peer_mutex);
 
-            b[offset]     = (v >> 56) & 0xFF;
-            b[offset + 1] = (v >> 48) & 0xFF;
-            b[offset + 2] = (v >> 40) & 0xFF;
-            b[offset + 3] = (v >> 32) & 0xFF;
-            b[offset + 4] = (v >> 24) & 0xFF;
-            b[offset + 5] = (v >> 16) & 0xFF;
-            b[offset + 6] = (v >>  8) & 0xFF;
-            b[offset + 7] =  v        & 0xFF;
+            peer_windows r;
+            for(const auto& p : _peers)
+            {
+                endpoint ep = {UDP, p.first.address().to_string(), p.first.port()};
+                r[make_address_str(ep)] = p.second.window;
+            }
+            return r;
         }
 
-        void write_be_32(u::bytes& b, size_t offset, int v)
+        peer_telemetry& udp_connection::telemetry(const udp::endpoint& ep)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(int));
+            auto i = _telemetry.find(ep);
+            if(i != _telemetry.end()) return i->second;
 
-            b[offset]     = (v >> 24) & 0xFF;
-            b[offset + 1] = (v >> 16) & 0xFF;
-            b[offset + 2] = (v >>  8) & 0xFF;
-            b[offset + 3] =  v        & 0xFF;
+            //a flood of spoofed sources should not grow the table without end
+            if(_telemetry.size() >= MAX_TELEMETRY_PEERS) return _untracked;
+            return _telemetry[ep];
         }
 
-        void write_be_u32(u::bytes& b, size_t offset, unsigned int v)
+        void udp_connection::schedule_stats()
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(unsigned int));
-
-            b[offset]     = (v >> 24) & 0xFF;
-            b[offset + 1] = (v >> 16) & 0xFF;
-            b[offset + 2] = (v >>  8) & 0xFF;
-            b[offset + 3] =  v        & 0xFF;
+            _stats_timer.expires_after(STATS_INTERVAL);
+            _stats_timer.async_wait(
+                    boost::bind(&udp_connection::handle_stats_timer, this,
+                        boost::asio::placeholders::error));
         }
 
-        void write_be_u16(u::bytes& b, size_t offset, uint16_t v)
+        void udp_connection::handle_stats_timer(const boost::system::error_code& error)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint16_t));
+            if(error) return;
 
-            b[offset]     = (v >> 8) & 0xFF;
-            b[offset + 1] =  v        & 0xFF;
+            const auto now = udp_clock::now();
+            publish_stats(now);
+            forget_idle_peers(now);
+            schedule_stats();
         }
 
-        void read_be_u64(const u::bytes& b, size_t offset, uint64_t& v)
+        double stats_average(double old, double sample)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint64_t));
+            return (1 - STATS_GAIN) * old + STATS_GAIN * sample;
+        }
 
-            uint64_t v8 = static_cast<unsigned char>(b[offset]);
-            uint64_t v7 = static_cast<unsigned char>(b[offset + 1]);
+        void udp_connection::publish_stats(udp_time now)
+        {
+            const double secs = std::chrono::duration<double>(now - _stats_at).count();
+            _stats_at = now;
+            if(secs <= 0) return;
+
+            auto table = std::make_shared<udp_peer_stats_table>();
+
+            u::mutex_scoped_lock l(_peer_mutex);
+            for(auto i = _telemetry.begin(); i != _telemetry.end();)
+            {
+                auto& t = i->second;
+                const size_t sent = t.bytes_sent - t.snap_bytes_sent;
+                const size_t recv = t.bytes_recv - t.snap_bytes_recv;
+                const size_t chunks = t.chunks_sent - t.snap_chunks_sent;
+                const size_t lost = t.lost - t.snap_lost;
+
+                t.send_rate = stats_average(t.send_rate, sent / secs);
+                t.recv_rate = stats_average(t.recv_rate, recv / secs);
+                if(chunks > 0) t.loss = stats_average(t.loss, std::min(1.0, lost * 1.0 / chunks));
+
+                t.snap_bytes_sent = t.bytes_sent;
+                t.snap_bytes_recv = t.bytes_recv;
+                t.snap_chunks_sent = t.chunks_sent;
+                t.snap_lost = t.lost;
+
+                t.idle = sent == 0 && recv == 0 ? t.idle + 1 : 0;
+                if(t.idle > STATS_IDLE) 
+                {
+                    i = _telemetry.erase(i);
+                    continue;
+                }
+
+                udp_peer_stats ps;
+                ps.loss = t.loss;
+                ps.resent = t.resent;
+                ps.duplicates = t.duplicates;
+                ps.send_rate = t.send_rate;
+                ps.recv_rate = t.recv_rate;
+
+                auto p = _peers.find(i->first);
+                if(p != _peers.end())
+                {
+                    ps.srtt = p->second.srtt;
+                    ps.min_rtt = p->second.min_rtt;
+                    ps.in_flight = p->second.in_flight;
+                    ps.window = p->second.window;
+                }
+
+                auto r = _in_peers.find(i->first);
+                if(r != _in_peers.end()) ps.reassembly_bytes = r->second.bytes;
+
+                endpoint ep = {UDP, i->first.address().to_string(), i->first.port()};
+                (*table)[make_address_str(ep)] = ps;
+                ++i;
+            }
+
+            //readers on other threads swap in the whole table without locking the socket
+            std::atomic_store(&_peer_stats, udp_peer_stats_ptr{table});
+        }
+
+        void udp_connection::on_prefix(prefix_handler h)
+        {
+            //the handler is only touched on the socket thread
+            _io.post(boost::bind(&udp_connection::set_prefix_handler, this, h));
+        }
+
+        void udp_connection::set_prefix_handler(prefix_handler h)
+        {
+            _prefix = h;
+        }
+
+        bool udp_connection::acked(message_ring_item& r, size_t chunk_n, udp_time now, double& rtt)
+        {
+            auto& wm = r.wm;
+            if(chunk_n >= wm.proto.total_chunks) return false;
+            if(wm.set[chunk_n] || !wm.sent[chunk_n]) return false;
+
+            wm.set[chunk_n] = 1;
+            if(wm.in_flight > 0 ) wm.in_flight--;
+            wm.last_progress = now;
+
+            auto& p = peer(wm.ep);
+            if(p.in_flight > 0) p.in_flight--;
+
+            //only chunks sent once give a clean rtt sample, 
+            //the freshest one has the least ack delay in it
+            if(!wm.resent[chunk_n])
+            {
+                const std::chrono::duration<double, std::milli> sample = now - wm.sent_at[chunk_n];
+                rtt = rtt < 0 ? sample.count() : std::min(rtt, sample.count());
+            }
+
+            window_acked(p);
+            fast_resend(r, chunk_n);
+            return true;
+        }
+
+        void udp_connection::validate_chunk(const message_chunk& c)
+        {
+            REQUIRE(c.type == message_chunk::ack || c.type == message_chunk::sack);
+
+            auto r = _message_ring.find(c.sequence);
+            if(!r) return;
+
+            auto& wm = r->wm;
+
+            if(wm.proto.type != message_chunk::msg) return;
+            if(c.total_chunks != wm.proto.total_chunks) return;
+
+            const auto now = udp_clock::now();
+            double rtt = -1;
+
+            if(c.type == message_chunk::ack) acked(*r, c.chunk, now, rtt);
+            else
+            {
+                //bitmap of chunks starting at c.chunk
+                const char* bitmap = c.payload;
+                const size_t bits = c.payload_size * 8;
+                for(size_t i = 0; i < bits; i++)
+                {
+                    if(bitmap[i / 8] == 0) { i += 7; continue; }
+                    if(bitmap[i / 8] & (0x80 >> (i % 8))) 
+                        acked(*r, c.chunk + i, now, rtt);
+                }
+            }
+
+            if(rtt >= 0) update_rtt(peer(wm.ep), rtt);
+
+            //if message is not complete yet, return 
+            if(wm.set.count() != wm.proto.total_chunks) return;
+
+            CHECK_EQUAL(wm.sent.count(), wm.proto.total_chunks);
+            CHECK_EQUAL(wm.in_flight, 0);
+            CHECK_EQUAL(wm.queued, 0);
+
+            //remove message from working
+            cleanup_message(*r);
+        }
+
+        void udp_connection::queue_ack(const udp::endpoint& from, const message_chunk& c)
+        {
+            REQUIRE(c.type == message_chunk::msg);
+
+            peer_sequence k{from, c.sequence};
+            auto& a = _pending_acks[k];
+            a.total_chunks = c.total_chunks;
+            a.chunks.push_back(c.chunk);
+            a.legacy = c.legacy;
+
+            if(a.chunks.size() >= ACK_EVERY) 
+            {
+                flush_acks(k);
+                return;
+            }
+
+            if(_ack_timer_armed) return;
+
+            _ack_timer_armed = true;
+            _ack_timer.expires_after(ACK_DELAY);
+            _ack_timer.async_wait(
+                    boost::bind(&udp_connection::handle_ack_timer, this, ba::placeholders::error));
+        }
+
+        void udp_connection::send_acks(const peer_sequence& k, pending_ack& a)
+        {
+            auto& ids = a.chunks;
+            if(ids.empty()) return;
+
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+            //the legacy format has no sacks, each chunk gets its own ack
+            if(a.legacy)
+            {
+                for(auto id : ids)
+                {
+                    message_chunk ack;
+                    ack.type = message_chunk::ack;
+                    ack.legacy = true;
+                    ack.ep = k.ep;
+                    ack.sequence = k.sequence;
+                    ack.total_chunks = a.total_chunks;
+                    ack.chunk = id;
+                    send_right_away(ack);
+                }
+                return;
+            }
+
+            //each sack covers as many chunks as fit in a chunk worth of bits
+            const size_t max_bits = UDP_CHuNK_SIZE * 8;
+
+            size_t i = 0;
+            while(i < ids.size())
+            {
+                const size_t base = ids[i];
+                size_t j = i;
+                while(j < ids.size() && ids[j] - base < max_bits) j++;
+
+                const size_t bits = ids[j - 1] - base + 1;
+
+                message_chunk sack;
+                sack.type = message_chunk::sack;
+                sack.ep = k.ep;
+                sack.sequence = k.sequence;
+                sack.total_chunks = a.total_chunks;
+                sack.chunk = base;
+                sack.data.resize((bits + 7) / 8, 0);
+
+                for(; i < j; i++)
+                {
+                    const size_t o = ids[i] - base;
+                    sack.data[o / 8] |= 0x80 >> (o % 8);
+                }
+
+                send_right_away(sack);
+            }
+        }
+
+        void udp_connection::flush_acks(const peer_sequence& k)
+        {
+            auto a = _pending_acks.find(k);
+            if(a == _pending_acks.end()) return;
+
+            send_acks(a->first, a->second);
+            _pending_acks.erase(a);
+        }
+
+        void udp_connection::handle_ack_timer(const boost::system::error_code& error)
+        {
+            if(error == ba::error::operation_aborted) return;
+            _ack_timer_armed = false;
+
+            for(auto& a : _pending_acks) send_acks(a.first, a.second);
+            _pending_acks.clear();
+        }
+
+        void udp_connection::add_completed(const peer_sequence& k)
+        {
+            if(!_completed.insert(k).second) return;
+            _completed_order.push_back(k);
+
+            //forget the oldest
+            if(_completed_order.size() <= MAX_COMPLETED) return;
+            _completed.erase(_completed_order.front());
+            _completed_order.pop_front();
+        }
+
+        void udp_connection::send_right_away(message_chunk& c)
+        {
+            _out_queue.emplace_push(c);
+            post_send();
+        }
+
+
+        message_chunk nth_chunk(size_t n, const message_chunk& prototype, const util::bytes& data)
+        {
+            REQUIRE_LESS(n, prototype.total_chunks);
+
+            size_t start = n * prototype.chunk_size;
+            size_t end = std::min(data.size(), start + prototype.chunk_size);
+            size_t size = end - start; 
+
+            CHECK_GREATER(size, 0);
+
+            message_chunk c = prototype;
+            c.chunk = n;
+            c.payload_size = size;
+            c.payload = data.data() + start;
+
+            ENSURE_EQUAL(c.chunk, n);
+            ENSURE(c.payload);
+            ENSURE_GREATER(c.payload_size, 0);
+            return c;
+        }
+
+        message_chunk nth_parity(size_t g, const working_message& wm)
+        {
+            const size_t psize = parity_size(wm.proto);
+            REQUIRE_LESS_EQUAL((g + 1) * psize, wm.parity.size());
+
+            message_chunk c = wm.proto;
+            c.chunk = wm.proto.total_chunks + g;
+            c.payload_size = psize;
+            c.payload = wm.parity.data() + g * psize;
+
+            ENSURE_GREATER_EQUAL(c.chunk, wm.proto.total_chunks);
+            return c;
+        }
+
+        bool udp_connection::get_next_chunk(working_message& wm, message_chunk& queued_chunk)
+        {
+            REQUIRE_GREATER(wm.proto.total_chunks, 0);
+            bool robust = wm.proto.type == message_chunk::msg;
+
+            //robust messages share the peer congestion window,
+            //unreliable ones are only limited by what is queued
+            if(robust)
+            {
+                const auto& p = peer(wm.ep);
+                if(p.in_flight + wm.queued >= static_cast<size_t>(p.window)) return false;
+            }
+            else if(wm.queued >= MAX_QUEUED) return false;
+
+            //parity for a group goes out right after its last chunk
+            const size_t total = wm.proto.total_chunks;
+            const size_t fec = wm.proto.fec;
+            if(wm.next_parity < parity_groups(total, fec) && 
+                    wm.next_send >= std::min(total, (wm.next_parity + 1) * fec))
+            {
+                queued_chunk = nth_parity(wm.next_parity, wm);
+                wm.next_parity++;
+                wm.queued++;
+                return true;
+            }
+
+            if(wm.next_send >= total) 
+                return false;
+
+            queued_chunk = nth_chunk(wm.next_send, wm.proto, wm.data);
+
+            wm.next_send++;
+            wm.queued++;
+            return true;
+        }
+
+        void udp_connection::queue_resend(message_ring_item& r, chunk_id_type nth)
+        {
+            r.resends.push_back(nth);
+            post_send();
+        }
+
+        size_t header_size(const message_chunk& c)
+        {
+            return c.legacy ? LEGACY_HEADER_SIZE : HEADER_SIZE;
+        }
+
+        long wire_size(const message_chunk& c)
+        {
+            return header_size(c) + c.payload_size;
+        }
+
+        bool udp_connection::next_flow_chunk(udp_flow& f, message_chunk& c)
+        {
+            //round robin the messages of the flow, visiting each at most once
+            const size_t n = f.messages.size();
+            for(size_t i = 0; i < n; i++)
+            {
+                const auto h = f.messages.front();
+                f.messages.pop_front();
+
+                //message was acked or purged
+                auto r = _message_ring.get(h);
+                if(!r) continue;
+
+                f.messages.push_back(h);
+
+                auto& wm = r->wm;
+                if(get_next_chunk(wm, c)) return true;
+
+                //check to see if there are resends
+                if(!r->resends.empty())
+                {
+                    c = nth_chunk(r->resends.front(), wm.proto, wm.data);
+                    r->resends.pop_front();
+                    c.resent = true;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool udp_connection::next_class_chunk(udp_class& k, message_chunk& c)
+        {
+            //each flow gets at most two turns, one to spend credit and one to get more
+            const auto now = udp_clock::now();
+            const size_t n = k.flows.size();
+            for(size_t i = 0; i < 2 * n && !k.flows.empty(); i++)
+            {
+                auto& f = k.flows.front();
+                auto& p = peer(f.ep);
+                if(f.deficit > 0 && paced(p.pace, now) && next_flow_chunk(f, c))
+                {
+                    f.deficit -= wire_size(c);
+                    spend(p.pace, wire_size(c));
+                    return true;
+                }
+
+                if(f.messages.empty())
+                {
+                    k.index.erase(f.ep);
+                    k.flows.pop_front();
+                    continue;
+                }
+
+                //a flow with nothing to send does not save up credit
+                if(f.deficit > 0) f.deficit = 0;
+                f.deficit += FLOW_QUANTUM;
+                k.flows.splice(k.flows.end(), k.flows, k.flows.begin());
+            }
+            return false;
+        }
+
+        void udp_connection::queue_next_chunk()
+        {
+            //wait for the upload cap
+            if(!paced(_upload, udp_clock::now())) return;
+
+            //deficit round robin over the classes so bulk transfers
+            //cannot starve realtime messages, and the reverse
+            message_chunk c;
+            for(size_t i = 0; i < 2 * PRIORITY_CLASSES; i++)
+            {
+                auto& k = _classes[_class_turn];
+                if(k.deficit > 0 && next_class_chunk(k, c))
+                {
+                    k.deficit -= wire_size(c);
+                    spend(_upload, wire_size(c));
+                    _out_queue.emplace_push(c);
+                    return;
+                }
+
+                //class is out of credit or has nothing to send, next class gets its turn
+                if(k.deficit > 0 || k.flows.empty()) k.deficit = 0;
+                _class_turn = (_class_turn + 1) % PRIORITY_CLASSES;
+                _classes[_class_turn].deficit += CLASS_QUANTUM[_class_turn];
+            }
+        }
+
+        bool udp_connection::paced(token_bucket& b, udp_time now)
+        {
+            refill(b, now);
+            if(b.rate <= 0 || b.tokens > 0) return true;
+
+            //come back when the bucket has tokens again
+            const auto wait = -b.tokens / b.rate;
+            schedule_pace(after(now, wait));
+            return false;
+        }
+
+        void udp_connection::schedule_pace(udp_time deadline)
+        {
+            if(_pace_timer_armed && _pace_timer_deadline <= deadline) return;
+
+            _pace_timer_armed = true;
+            _pace_timer_deadline = deadline;
+            _pace_timer.expires_at(deadline);
+            _pace_timer.async_wait(
+                    boost::bind(&udp_connection::handle_pace_timer, this, ba::placeholders::error));
+        }
+
+        void udp_connection::handle_pace_timer(const boost::system::error_code& error)
+        {
+            if(error == ba::error::operation_aborted) return;
+            _pace_timer_armed = false;
+            do_send();
+        }
+
+        chunk_total_type total_chunks(size_t data_size, size_t chunk_size)
+        {
+            REQUIRE_GREATER(data_size, 0);
+            REQUIRE_GREATER(chunk_size, 0);
+
+            size_t r = (data_size / chunk_size);
+            if(data_size % chunk_size) r += 1;
+
+            ENSURE_RANGE(r, 1, MAX_MESSAGE_CHUNKS + 1);
+            return r;
+        }
+
+        size_t max_message_size(const endpoint_message& m)
+        {
+            return m.fec > 0 ? MAX_FEC_MESSAGE_SIZE : MAX_MESSAGE_SIZE;
+        }
+
+        message_chunk create_prototype(
+                sequence_type sequence, 
+                const endpoint_message& m, 
+                const udp::endpoint& ep, 
+                size_t chunk_size)
+        {
+            REQUIRE_RANGE(chunk_size, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE + 1);
+
+            message_chunk c;
+            c.valid = true;
+            c.type = m.robust || m.stream ? message_chunk::msg : message_chunk::qmsg;
+            c.stream = m.stream;
+            c.ep = ep;
+            c.sequence = sequence;
+            c.total_chunks = total_chunks(m.data.size(), chunk_size);
+            c.chunk = 0;
+            c.chunk_size = chunk_size;
+
+            //parity chunk ids come after the data chunks and have to fit too, 
+            //as does the parity in what the peer holds for one message.
+            //a single chunk message gains nothing from parity
+            const size_t fec = std::min(m.fec, MAX_FEC);
+            const size_t groups = parity_groups(c.total_chunks, fec);
+            const size_t held = c.total_chunks * chunk_size + groups * (chunk_size + FEC_TRAILER_SIZE);
+            if(c.total_chunks > 1 && c.total_chunks + groups <= MAX_CHUNKS && held <= PEER_REASSEMBLY_QUOTA)
+                c.fec = fec;
+
+            return c;
+        }
+
+        void udp_connection::post_send()
+        {
+            _io.post(boost::bind(&udp_connection::do_send, this));
+        }
+
+        void udp_connection::add_to_working_set(endpoint_message m)
+        {
+            REQUIRE_FALSE(m.data.empty());
+
+            //update sequence
+            _sequence += shard_count();
+
+            //chunk with the largest size known to make it to the peer
+            const udp::endpoint ep(address::from_string(m.ep.address), m.ep.port);
+            auto& p = peer(ep);
+            if(p.probe == udp_peer::unprobed) start_probe(p, ep);
+
+            //stream frames are newer than the legacy format, 
+            //peers that cannot read them have no use for them either
+            const bool legacy = p.legacy && !m.stream;
+            if(legacy) m.fec = 0;
+
+            const size_t chunk_size = legacy ? 
+                LEGACY_CHUNK_SIZE : 
+                p.packet_size - HEADER_SIZE - (m.fec > 0 ? FEC_TRAILER_SIZE : 0);
+            message_chunk proto = create_prototype(_sequence, m, ep, chunk_size);
+            proto.legacy = legacy;
+            init_working(proto, m.data, m.priority);
+        }
+
+        void udp_connection::start_probe(udp_peer& p, const udp::endpoint& ep)
+        {
+            p.probe = udp_peer::probing;
+            p.probe_rung = 0;
+            p.probe_tries = 0;
+            send_probe(p, ep);
+        }
+
+        void udp_connection::send_probe(udp_peer& p, const udp::endpoint& ep)
+        {
+            REQUIRE(p.probe == udp_peer::probing);
+            REQUIRE_LESS(p.probe_rung, PROBE_RUNGS);
+
+            const size_t size = PROBE_SIZES[p.probe_rung];
+            CHECK_RANGE(size, HEADER_SIZE, MAX_PACKET_SIZE + 1);
+
+            _probe_id += shard_count();
+            p.probe_id = _probe_id;
+            p.probe_tries++;
+            p.probe_deadline = after(udp_clock::now(), p.rto);
+
+            //probe is padded to the size tested. the socket sets the 
+            //don't fragment bit so it only arrives if the path can take it
+            message_chunk c;
+            c.type = message_chunk::probe;
+            c.ep = ep;
+            c.sequence = p.probe_id;
+            c.chunk = 0;
+            c.chunk_size = size;
+            c.data.resize(size - HEADER_SIZE, 0);
+
+            send_right_away(c);
+            schedule_probe(p.probe_deadline);
+        }
+
+        void udp_connection::schedule_probe(udp_time deadline)
+        {
+            if(_probe_timer_armed && _probe_timer_deadline <= deadline) return;
+
+            _probe_timer_armed = true;
+            _probe_timer_deadline = deadline;
+            _probe_timer.expires_at(deadline);
+            _probe_timer.async_wait(
+                    boost::bind(&udp_connection::handle_probe_timer, this, ba::placeholders::error));
+        }
+
+        void udp_connection::handle_probe_timer(const boost::system::error_code& error)
+        {
+            if(error == ba::error::operation_aborted) return;
+            _probe_timer_armed = false;
+
+            const auto now = udp_clock::now();
+
+            std::vector<std::pair<udp_peer*, udp::endpoint>> resend;
+            udp_time next = udp_time::max();
+            {
+                u::mutex_scoped_lock l(_peer_mutex);
+                for(auto& i : _peers)
+                {
+                    auto& p = i.second;
+                    if(p.probe != udp_peer::probing) continue;
+                    if(p.probe_deadline > now) 
+                    {
+                        next = std::min(next, p.probe_deadline);
+                        continue;
+                    }
+
+                    //no reply, try again and then step down the ladder
+                    if(p.probe_tries >= PROBE_TRIES)
+                    {
+                        p.probe_rung++;
+                        p.probe_tries = 0;
+                    }
+
+                    //nothing larger made it, stay with the smallest size
+                    if(p.probe_rung >= PROBE_RUNGS)
+                    {
+                        p.probe = udp_peer::probed;
+                        p.packet_size = UDP_PACKET_SIZE;
+                        continue;
+                    }
+                    resend.emplace_back(&p, i.first);
+                }
+            }
+
+            //peers are only removed by the stats timer, so the pointers stay valid
+            for(auto& r : resend) send_probe(*r.first, r.second);
+            if(next != udp_time::max()) schedule_probe(next);
+        }
+
+        void udp_connection::probe_acked(const udp::endpoint& from, const message_chunk& c)
+        {
+            REQUIRE(c.type == message_chunk::probe_ack);
+
+            //only peers we probed, so stray acks do not add peers
+            auto p = find_peer(from);
+            if(!p || p->probe != udp_peer::probing) return;
+            if(c.sequence != p->probe_id || p->probe_rung >= PROBE_RUNGS) return;
+            if(c.chunk_size != PROBE_SIZES[p->probe_rung]) return;
+
+            //sizes are tried largest first, so the first one back is the one to use.
+            //only peers that read the current wire format answer probes
+            u::mutex_scoped_lock l(_peer_mutex);
+            p->probe = udp_peer::probed;
+            p->packet_size = c.chunk_size;
+            p->legacy = false;
+            LOG << "udp path mtu to " << from << " is " << p->packet_size << " bytes" << std::endl;
+        }
+
+        void udp_connection::packet_too_big(const udp::endpoint& ep)
+        {
+            //probes are allowed to fail
+            auto p = find_peer(ep);
+            if(!p || p->probe != udp_peer::probed || p->packet_size <= UDP_PACKET_SIZE) return;
+
+            //the kernel learned a smaller path mtu, probe again
+            u::mutex_scoped_lock l(_peer_mutex);
+            p->packet_size = UDP_PACKET_SIZE;
+            p->probe = udp_peer::unprobed;
+        }
+
+        bool udp_connection::send(const endpoint_message& m, bool block)
+        {
+            INVARIANT(_socket);
+            if(m.data.empty()) return false;
+            if(m.data.size() > max_message_size(m))
+            {
+                LOG << "message of size `" << m.data.size() << "' is larger than the max message size of `" << max_message_size(m) << "'" << std::endl;
+                return false;
+            }
+
+            //blocking waits for earlier messages to drain instead of queueing without bound
+            _budget.take(m.data.size(), block);
+            queue_message(m);
+            return true;
+        }
+
+        send_status udp_connection::try_send(const endpoint_message& m)
+        {
+            INVARIANT(_socket);
+            if(m.data.empty() || m.data.size() > max_message_size(m)) return send_status::failed;
+            if(!_budget.try_take(m.data.size())) return send_status::would_block;
+
+            queue_message(m);
+            return send_status::queued;
+        }
+
+        void udp_connection::queue_message(const endpoint_message& m)
+        {
+            _io.post(boost::bind(&udp_connection::add_to_working_set, this, m));
+            _io.post(boost::bind(&udp_connection::do_send, this));
+        }
+
+        void write_be_u64(u::bytes& b, size_t offset, uint64_t v)
+        {
+            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint64_t));
+
+            b[offset]     = (v >> 56) & 0xFF;
+            b[offset + 1] = (v >> 48) & 0xFF;
+            b[offset + 2] = (v >> 40) & 0xFF;
+            b[offset + 3] = (v >> 32) & 0xFF;
+            b[offset + 4] = (v >> 24) & 0xFF;
+            b[offset + 5] = (v >> 16) & 0xFF;
+            b[offset + 6] = (v >>  8) & 0xFF;
+            b[offset + 7] =  v        & 0xFF;
+        }
+
+        void write_be_32(u::bytes& b, size_t offset, int v)
+        {
+            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(int));
+
+            b[offset]     = (v >> 24) & 0xFF;
+            b[offset + 1] = (v >> 16) & 0xFF;
+            b[offset + 2] = (v >>  8) & 0xFF;
+            b[offset + 3] =  v        & 0xFF;
+        }
+
+        void write_be_u32(u::bytes& b, size_t offset, unsigned int v)
+        {
+            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(unsigned int));
+
+            b[offset]     = (v >> 24) & 0xFF;
+            b[offset + 1] = (v >> 16) & 0xFF;
+            b[offset + 2] = (v >>  8) & 0xFF;
+            b[offset + 3] =  v        & 0xFF;
+        }
+
+        void write_be_u16(u::bytes& b, size_t offset, uint16_t v)
+        {
+            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint16_t));
+
+            b[offset]     = (v >> 8) & 0xFF;
+            b[offset + 1] =  v        & 0xFF;
+        }
+
+        void read_be_u64(const char* b, size_t size, size_t offset, uint64_t& v)
+        {
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(uint64_t));
+
+            uint64_t v8 = static_cast<unsigned char>(b[offset]);
+            uint64_t v7 = static_cast<unsigned char>(b[offset + 1]);
             uint64_t v6 = static_cast<unsigned char>(b[offset + 2]);
             uint64_t v5 = static_cast<unsigned char>(b[offset + 3]);
             uint64_t v4 = static_cast<unsigned char>(b[offset + 4]);
@@ -410,9 +1587,10 @@ namespace fire
                 v1;
         }
 
-        void read_be_32(const u::bytes& b, size_t offset, int& v)
+        void read_be_32(const char* b, size_t size, size_t offset, int& v)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(int));
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(int));
 
             int v4 = static_cast<unsigned char>(b[offset]);
             int v3 = static_cast<unsigned char>(b[offset + 1]);
@@ -425,9 +1603,10 @@ namespace fire
                 v1;
         }
 
-        void read_be_u32(const u::bytes& b, size_t offset, unsigned int& v)
+        void read_be_u32(const char* b, size_t size, size_t offset, unsigned int& v)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(unsigned int));
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(unsigned int));
             unsigned int v4 = static_cast<unsigned char>(b[offset]);
             unsigned int v3 = static_cast<unsigned char>(b[offset + 1]);
             unsigned int v2 = static_cast<unsigned char>(b[offset + 2]);
@@ -439,116 +1618,504 @@ namespace fire
                 v1;
         }
 
-        void read_be_u16(const u::bytes& b, size_t offset, uint16_t& v)
+        void read_be_u16(const char* b, size_t size, size_t offset, uint16_t& v)
+        {
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(uint16_t));
+            uint16_t v2 = static_cast<unsigned char>(b[offset]);
+            uint16_t v1 = static_cast<unsigned char>(b[offset + 1]);
+
+            v = (v2 <<  8) | v1;
+        }
+
+        void encode_udp_wire(u::bytes& r, const message_chunk& ch)
+        {
+            //payload is either borrowed from the message or owned by the chunk
+            const char* payload = ch.payload ? ch.payload : ch.data.data();
+            const size_t payload_size = ch.payload ? ch.payload_size : ch.data.size();
+
+            const size_t header = header_size(ch);
+            r.resize(header + payload_size);
+
+            //set mark. the legacy format has its own marks, 
+            //so older peers drop what they cannot read
+            switch(ch.type)
+            {
+                case message_chunk::msg: r[0] = ch.legacy ? '!' : ch.stream ? '$' : '*'; break;
+                case message_chunk::qmsg: r[0] = ch.legacy ? '=' : '~'; break;
+                case message_chunk::ack: CHECK(ch.legacy); r[0] = '@'; break;
+                case message_chunk::sack: r[0] = '#'; break;
+                case message_chunk::probe: r[0] = '?'; break;
+                case message_chunk::probe_ack: r[0] = '^'; break;
+                default: CHECK(false && "missed case");
+            }
+
+            //write sequence number
+            write_be_u64(r, SEQUENCE_BASE, ch.sequence);
+
+            //write total chunks
+            write_be_u16(r, CHUNK_TOTAL_BASE, ch.total_chunks);
+
+            //write message_chunk number
+            write_be_u16(r, CHUNK_BASE, ch.chunk);
+
+            if(!ch.legacy)
+            {
+                //write chunk size
+                write_be_u16(r, CHUNK_SIZE_BASE, ch.chunk_size);
+
+                //write parity group size
+                r[FEC_BASE] = ch.fec;
+            }
+
+            //write message
+            if(payload_size > 0) 
+                std::copy(payload, payload + payload_size, r.begin() + header);
+        }
+
+        message_chunk decode_udp_wire(const char* b, size_t size)
+        {
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size, LEGACY_HEADER_SIZE);
+
+            message_chunk ch;
+            ch.valid = false;
+
+            //read mark
+            const char mark = b[0];
+            switch(mark)
+            {
+                case '!': ch.type = message_chunk::msg; ch.legacy = true; break;
+                case '=': ch.type = message_chunk::qmsg; ch.legacy = true; break;
+                case '@': ch.type = message_chunk::ack; ch.legacy = true; break;
+                case '*': ch.type = message_chunk::msg; break;
+                case '$': ch.type = message_chunk::msg; ch.stream = true; break;
+                case '~': ch.type = message_chunk::qmsg; break;
+                case '#': ch.type = message_chunk::sack; break;
+                case '?': ch.type = message_chunk::probe; break;
+                case '^': ch.type = message_chunk::probe_ack; break;
+                default: return ch;
+            }
+
+            const size_t header = header_size(ch);
+            if(size < header) return ch;
+
+            //read sequence number
+            read_be_u64(b, size, SEQUENCE_BASE, ch.sequence);
+
+            //read total chunks 
+            read_be_u16(b, size, CHUNK_TOTAL_BASE, ch.total_chunks);
+
+            //cannot be more than max chunks, this should be impossible because
+            //total_chunks should be a unsigned short
+            CHECK_LESS_EQUAL(ch.total_chunks, MAX_CHUNKS);
+
+            //read message_chunk number
+            read_be_u16(b, size, CHUNK_BASE, ch.chunk);
+
+            if(ch.legacy) ch.chunk_size = LEGACY_CHUNK_SIZE;
+            else
+            {
+                //read chunk size
+                read_be_u16(b, size, CHUNK_SIZE_BASE, ch.chunk_size);
+
+                //read parity group size
+                ch.fec = static_cast<fec_type>(b[FEC_BASE]);
+            }
+
+            //payload points into the datagram, nothing is copied 
+            //until it lands in the message it belongs to
+            const size_t data_size = size - header;
+            if(data_size > MAX_UDP_BUFF_SIZE) return ch;
+            if(data_size > 0)
+            {
+                ch.payload = b + header;
+                ch.payload_size = data_size;
+            }
+
+            ch.valid = true;
+
+            return ch;
+        }
+
+        bool is_control(const message_chunk& c)
+        {
+            return c.type != message_chunk::msg && c.type != message_chunk::qmsg;
+        }
+
+        void udp_connection::do_send()
+        {
+            ENSURE(_socket);
+#ifdef FIRESTR_UDP_URING
+            if(_ring)
+            {
+                send_ring();
+                return;
+            }
+#endif
+#ifdef FIRESTR_UDP_MMSG
+            if(_batched) 
+            {
+                send_batch();
+                return;
+            }
+#endif
+            send_one();
+        }
+
+        void udp_connection::send_one()
+        {
+            ENSURE(_socket);
+
+            if(_out_queue.empty()) queue_next_chunk();
+            if(_out_queue.empty()) return;
+
+            //encode bytes to wire format
+            message_chunk message_chunk;
+            bool got = _out_queue.pop(message_chunk);
+            CHECK(got);
+
+            encode_udp_wire(_out_buffer, message_chunk);
+            _stats.bytes_sent += _out_buffer.size();
+            telemetry(message_chunk.ep).bytes_sent += _out_buffer.size();
+            _stats.packets_sent++;
+            _stats.send_calls++;
+
+            //async send message_chunk
+            _socket->async_send_to(ba::buffer(_out_buffer.data(), _out_buffer.size()), message_chunk.ep,
+                    boost::bind(&udp_connection::handle_write, this, ba::placeholders::error));
+
+            //ignore acks and probes
+            if(is_control(message_chunk)) return;
+            if(message_chunk.resent) resent_chunk(message_chunk);
+            else sent_chunk(message_chunk);
+
+        }
+
+#ifdef FIRESTR_UDP_MMSG
+        void udp_connection::send_batch()
+        {
+            //waiting on the socket to drain a previous batch
+            if(_writing) return;
+
+            do { if(!flush_batch()) return; }
+            while(fill_batch());
+        }
+
+        bool udp_connection::fill_batch()
+        {
+            auto& b = _out_batch;
+            REQUIRE_EQUAL(b.start, b.size);
+
+            b.start = 0;
+            b.size = 0;
+            while(b.size < MAX_BATCH)
+            {
+                if(_out_queue.empty()) queue_next_chunk();
+
+                message_chunk c;
+                if(!_out_queue.pop(c)) break;
+
+                encode_udp_wire(b.data[b.size], c);
+                b.eps[b.size] = c.ep;
+                _stats.bytes_sent += b.data[b.size].size();
+                telemetry(c.ep).bytes_sent += b.data[b.size].size();
+                b.size++;
+
+                //chunk is copied into the batch so bookkeeping can happen now.
+                //ignore acks and probes
+                if(is_control(c)) continue;
+                if(c.resent) resent_chunk(c);
+                else sent_chunk(c);
+            }
+
+            ENSURE_LESS_EQUAL(b.size, MAX_BATCH);
+            return b.size > 0;
+        }
+
+        bool udp_connection::flush_batch()
+        {
+            INVARIANT(_socket);
+            auto& b = _out_batch;
+
+            std::array<mmsghdr, MAX_BATCH> msgs;
+            std::array<iovec, MAX_BATCH> iovs;
+
+            while(b.start < b.size)
+            {
+                const size_t n = b.size - b.start;
+                for(size_t i = 0; i < n; i++)
+                {
+                    auto& d = b.data[b.start + i];
+                    auto& ep = b.eps[b.start + i];
+                    iovs[i].iov_base = d.data();
+                    iovs[i].iov_len = d.size();
+                    msgs[i].msg_hdr = msghdr{};
+                    msgs[i].msg_hdr.msg_name = ep.data();
+                    msgs[i].msg_hdr.msg_namelen = ep.size();
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_len = 0;
+                }
+
+                int sent = sendmmsg(_socket->native_handle(), msgs.data(), n, 0);
+                _stats.send_calls++;
+
+                if(sent > 0)
+                {
+                    _stats.packets_sent += sent;
+                    b.start += sent;
+                    continue;
+                }
+
+                const int err = errno;
+                if(err == EAGAIN || err == EWOULDBLOCK)
+                {
+                    //try again once the socket can take more
+                    _writing = true;
+                    _socket->async_wait(udp::socket::wait_write,
+                            boost::bind(&udp_connection::handle_writable, this, ba::placeholders::error));
+                    return false;
+                }
+                if(err == EINTR) continue;
+                if(err == EMSGSIZE) packet_too_big(b.eps[b.start]);
+
+                _error = boost::system::error_code(err, boost::system::system_category());
+                if(err == ENOSYS)
+                {
+                    //no kernel support, drop to sending one chunk at a time
+                    LOG << "sendmmsg unsupported, using single datagram sends." << std::endl;
+                    _batched = false;
+                    for(; b.start < b.size; b.start++)
+                    {
+                        boost::system::error_code ec;
+                        _socket->send_to(ba::buffer(b.data[b.start]), b.eps[b.start], 0, ec);
+                        _stats.send_calls++;
+                        if(!ec) _stats.packets_sent++;
+                    }
+                    post_send();
+                    return false;
+                }
+
+                //the first datagram failed, skip it like a failed async send
+                b.start++;
+            }
+
+            ENSURE_EQUAL(b.start, b.size);
+            return true;
+        }
+
+        void udp_connection::handle_writable(const boost::system::error_code& error)
+        {
+            _writing = false;
+            if(error) 
+            {
+                _error = error;
+                if(error == ba::error::operation_aborted) return;
+            }
+            do_send();
+        }
+
+        void udp_connection::read_batch()
+        {
+            INVARIANT(_socket);
+            auto& b = _in_batch;
+
+            std::array<mmsghdr, MAX_BATCH> msgs;
+            std::array<iovec, MAX_BATCH> iovs;
+
+            while(_batched)
+            {
+                for(size_t i = 0; i < MAX_BATCH; i++)
+                {
+                    auto& d = b.data[i];
+                    auto& ep = b.eps[i];
+                    iovs[i].iov_base = d.data();
+                    iovs[i].iov_len = d.size();
+                    msgs[i].msg_hdr = msghdr{};
+                    msgs[i].msg_hdr.msg_name = ep.data();
+                    msgs[i].msg_hdr.msg_namelen = ep.capacity();
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_len = 0;
+                }
+
+                int got = recvmmsg(_socket->native_handle(), msgs.data(), MAX_BATCH, 0, nullptr);
+                _stats.recv_calls++;
+
+                if(got < 0)
+                {
+                    const int err = errno;
+                    if(err == EINTR) continue;
+                    if(err == EAGAIN || err == EWOULDBLOCK) break;
+
+                    _error = boost::system::error_code(err, boost::system::system_category());
+                    if(err == ENOSYS)
+                    {
+                        LOG << "recvmmsg unsupported, using single datagram reads." << std::endl;
+                        _batched = false;
+                    }
+                    break;
+                }
+
+                _stats.packets_recv += got;
+                for(int i = 0; i < got; i++)
+                {
+                    const auto& h = msgs[i].msg_hdr;
+                    if(h.msg_flags & MSG_TRUNC) continue;
+
+                    b.eps[i].resize(h.msg_namelen);
+                    handle_datagram(b.data[i].data(), msgs[i].msg_len, b.eps[i]);
+                }
+
+                //a short batch means the socket is drained
+                if(static_cast<size_t>(got) < MAX_BATCH) break;
+            }
+        }
+
+        void udp_connection::handle_readable(const boost::system::error_code& error)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint16_t));
-            uint16_t v2 = static_cast<unsigned char>(b[offset]);
-            uint16_t v1 = static_cast<unsigned char>(b[offset + 1]);
+            if(error)
+            {
+                _error = error;
+                LOG << "error waiting for udp messages. " << error.message() << std::endl;
+                start_read();
+                return;
+            }
 
-            v = (v2 <<  8) | v1;
+            read_batch();
+            start_read();
         }
+#endif
 
-        void encode_udp_wire(u::bytes& r, const message_chunk& ch)
+#ifdef FIRESTR_UDP_URING
+        bool udp_connection::start_ring()
         {
-            r.resize(HEADER_SIZE + ch.write_size);
+            if(!_use_ring || _error) return false;
 
-            //set mark
-            switch(ch.type)
+            //the socket stays blocking so the ring waits on a full send buffer instead of failing
+            _ring.reset(new udp_ring{_io, _socket->native_handle(), MAX_UDP_BUFF_SIZE, MAX_BATCH,
+                    [this](const char* data, size_t size, const udp::endpoint& from)
+                    {
+                        _stats.packets_recv++;
+                        handle_datagram(data, size, from);
+                    },
+                    boost::bind(&udp_connection::ring_sent, this, _1, _2)});
+
+            if(!_ring->ok())
             {
-                case message_chunk::msg: r[0] = '!'; break;
-                case message_chunk::qmsg: r[0] = '='; break;
-                case message_chunk::ack: r[0] = '@'; break;
-                default: CHECK(false && "missed case");
+                _ring.reset();
+                return false;
             }
 
-            //write sequence number
-            write_be_u64(r, SEQUENCE_BASE, ch.sequence);
-
-            //write total chunks
-            write_be_u16(r, CHUNK_TOTAL_BASE, ch.total_chunks);
-
-            //write message_chunk number
-            write_be_u16(r, CHUNK_BASE, ch.chunk);
-
-            //write message
-            if(ch.write_size > 0 && ch.write_data != nullptr) 
-                std::copy(ch.write_data, ch.write_data + ch.write_size, r.begin() + MESSAGE_BASE);
+            //the receive is armed on the socket thread, which is where the kernel completes it
+            _io.post(boost::bind(&udp_connection::arm_ring, this));
+            return true;
         }
 
-        message_chunk decode_udp_wire(const u::bytes& b)
+        void udp_connection::arm_ring()
         {
-            REQUIRE_GREATER_EQUAL(b.size(), HEADER_SIZE);
-
-            message_chunk ch;
-            ch.valid = false;
-
-            //read mark
-            const char mark = b[0];
-            switch(mark)
+            if(!_ring) return;
+            if(!_ring->start())
             {
-                case '!': ch.type = message_chunk::msg; break;
-                case '=': ch.type = message_chunk::qmsg; break;
-                case '@': ch.type = message_chunk::ack; break;
-                default: return ch;
+                drop_ring();
+                return;
             }
 
-            //read sequence number
-            if(b.size() < SEQUENCE_BASE + sizeof(sequence_type)) return ch;
-            read_be_u64(b, SEQUENCE_BASE, ch.sequence);
+            LOG << "udp io through io_uring" << std::endl;
+            _ring->wait(boost::bind(&udp_connection::handle_ring, this, ba::placeholders::error));
+        }
 
-            //write total chunks 
-            if(b.size() < CHUNK_TOTAL_BASE + sizeof(chunk_total_type)) return ch;
-            read_be_u16(b, CHUNK_TOTAL_BASE, ch.total_chunks);
+        void udp_connection::drop_ring()
+        {
+            LOG << "io_uring udp failed, using asio." << std::endl;
+            _ring.reset();
 
-            //cannot be more than max chunks, this should be impossible because
-            //total_chunks should be a unsigned short
-            CHECK_LESS_EQUAL(ch.total_chunks, MAX_CHUNKS);
+            //datagrams the ring did not finish are lost, resends cover robust ones
+            _out_batch.start = _out_batch.size;
+            _writing = false;
 
-            //read message_chunk number
-            if(b.size() < CHUNK_BASE + sizeof(chunk_id_type)) return ch;
-            read_be_u16(b, CHUNK_BASE, ch.chunk);
+#ifdef FIRESTR_UDP_MMSG
+            _socket->non_blocking(true, _error);
+#endif
+            start_read();
+            post_send();
+        }
 
-            //copy message
-            CHECK_GREATER_EQUAL(b.size(), HEADER_SIZE);
-            const size_t data_size = b.size() - HEADER_SIZE;
+        void udp_connection::send_ring()
+        {
+            INVARIANT(_ring);
 
-            if(data_size > 0)
+            auto& b = _out_batch;
+            while(true)
             {
-                if(data_size > MAX_UDP_BUFF_SIZE) return ch;
-                ch.data.resize(data_size);
-                std::copy(b.begin() + MESSAGE_BASE, b.end(), ch.data.begin());
-            }
+                //a batch stays put until the kernel is done with all of it
+                if(!_writing)
+                {
+                    if(!fill_batch()) return;
+                    _ring_next = b.start;
+                    _writing = true;
+                    _stats.send_calls++;
+                }
 
-            ch.valid = true;
+                //submissions the kernel turned away with busy can still fill the ring.
+                //the rest of the batch goes in once completions make room
+                while(_ring_next < b.size && _ring->queue_send(_ring_next, b.data[_ring_next], b.eps[_ring_next])) 
+                    _ring_next++;
 
-            return ch;
+                if(!_ring->submit())
+                {
+                    drop_ring();
+                    return;
+                }
+
+                //most sends finish inside the submit, so their completions are already there
+                _ring->reap();
+                if(_writing) return;
+            }
         }
 
-        void udp_connection::do_send()
+        void udp_connection::ring_sent(size_t slot, int result)
         {
-            ENSURE(_socket);
-
-            if(_out_queue.empty()) queue_next_chunk();
-            if(_out_queue.empty()) return;
+            auto& b = _out_batch;
+            REQUIRE_LESS(slot, b.size);
+            REQUIRE_LESS(b.start, b.size);
 
-            //encode bytes to wire format
-            message_chunk message_chunk;
-            bool got = _out_queue.pop(message_chunk);
-            CHECK(got);
+            if(result >= 0) _stats.packets_sent++;
+            else
+            {
+                if(result == -EMSGSIZE) packet_too_big(b.eps[slot]);
+                _error = boost::system::error_code(-result, boost::system::system_category());
+            }
 
-            encode_udp_wire(_out_buffer, message_chunk);
-            _stats.bytes_sent += _out_buffer.size();
+            //completions count up the batch, in whatever order they come
+            b.start++;
+            if(b.start == b.size) _writing = false;
+        }
 
-            //async send message_chunk
-            udp::endpoint ep(address::from_string(message_chunk.host), message_chunk.port);
-            _socket->async_send_to(ba::buffer(_out_buffer.data(), _out_buffer.size()), ep,
-                    boost::bind(&udp_connection::handle_write, this, ba::placeholders::error));
+        void udp_connection::handle_ring(const boost::system::error_code& error)
+        {
+            if(error == ba::error::operation_aborted || !_ring) return;
+            if(error)
+            {
+                _error = error;
+                LOG << "error waiting on io_uring. " << error.message() << std::endl;
+            }
 
-            //ignore acks or resends
-            if(!message_chunk.resent && message_chunk.type != message_chunk::ack)
-                sent_chunk(message_chunk);
+            _stats.recv_calls++;
+            _ring->reap();
+            if(_ring->failed()) 
+            {
+                drop_ring();
+                return;
+            }
 
+            //also picks up the rest of a batch the ring had no room for
+            do_send();
+            if(!_ring) return;
+            _ring->wait(boost::bind(&udp_connection::handle_ring, this, ba::placeholders::error));
         }
+#endif
 
         void udp_connection::handle_write(const boost::system::error_code& error)
         {
@@ -563,16 +2130,60 @@ namespace fire
 
             _socket->open(udp::v4(), _error);
             _socket->set_option(udp::socket::reuse_address(true),_error);
+
+#ifdef FIRESTR_UDP_REUSEPORT
+            //the kernel spreads peers over the sockets bound to the port
+            if(shard_count() > 1)
+            {
+                int on = 1;
+                if(setsockopt(_socket->native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+                    LOG << "unable to set SO_REUSEPORT on udp socket" << std::endl;
+            }
+#endif
+
+            //room for a full congestion window of chunks
+            const int buffer_size = MAX_WINDOW * MAX_PACKET_SIZE;
+            _socket->set_option(ba::socket_base::receive_buffer_size(buffer_size), _error);
+            _socket->set_option(ba::socket_base::send_buffer_size(buffer_size), _error);
+
+#if defined(__linux__) && defined(IP_MTU_DISCOVER)
+            //set don't fragment so mtu probes larger than the path are dropped
+            int pmtu = IP_PMTUDISC_DO;
+            if(setsockopt(_socket->native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) != 0)
+                LOG << "unable to set don't fragment on udp socket" << std::endl;
+#endif
+
             _socket->bind(udp::endpoint(udp::v4(), port), _error);
 
             if(_error)
                 LOG << "error binding udp to port " << port << ": " << _error.message() << std::endl;
 
-            start_read();
+#ifdef FIRESTR_UDP_URING
+            if(!start_ring())
+#endif
+            {
+#ifdef FIRESTR_UDP_MMSG
+                //batched reads drain the socket until it would block
+                _socket->non_blocking(true, _error);
+#endif
+                start_read();
+            }
+
+            _stats_at = udp_clock::now();
+            schedule_stats();
         }
 
         void udp_connection::start_read()
         {
+#ifdef FIRESTR_UDP_MMSG
+            if(_batched)
+            {
+                _socket->async_wait(udp::socket::wait_read,
+                        boost::bind(&udp_connection::handle_readable, this,
+                            boost::asio::placeholders::error));
+                return;
+            }
+#endif
             _socket->async_receive_from(
                    ba::buffer(_in_buffer, MAX_UDP_BUFF_SIZE), _in_endpoint,
                     boost::bind(&udp_connection::handle_read, this,
@@ -580,59 +2191,291 @@ namespace fire
                         boost::asio::placeholders::bytes_transferred));
         }
 
-        bool insert_chunk(const message_chunk& c, working_messages& w, u::bytes& complete_message)
+        void rebuild(working_message& wm, size_t g, chunk_ids& rebuilt)
         {
-            REQUIRE(c.type == message_chunk::msg || c.type == message_chunk::qmsg);
-            if(c.total_chunks == 0) return false;
+            if(!wm.parity_set[g]) return;
+
+            const size_t total = wm.proto.total_chunks;
+            const size_t fec = wm.proto.fec;
+            const size_t chunk_size = wm.proto.chunk_size;
+            const size_t start = g * fec;
+            const size_t end = std::min(total, start + fec);
+
+            //parity only covers one missing chunk per group
+            size_t missing = end;
+            for(size_t n = start; n < end; n++)
+            {
+                if(wm.set[n]) continue;
+                if(missing != end) return;
+                missing = n;
+            }
+            if(missing == end) return;
+
+            const size_t psize = parity_size(wm.proto);
+            const char* parity = wm.parity.data() + g * psize;
 
-            auto& wm = w[c.sequence];
-            if(wm.proto.total_chunks == 0)
+            size_t size = chunk_size;
+            if(missing == total - 1)
             {
-                const size_t max_size = c.total_chunks * UDP_CHuNK_SIZE;
-                if(max_size > MAX_MESSAGE_SIZE) return false;
+                chunk_size_type last = 0;
+                read_be_u16(parity, psize, chunk_size, last);
+                if(last == 0 || last > chunk_size) return;
+                size = last;
+            }
 
-                wm.proto = c;
-                wm.proto.data.clear();
-                wm.data.resize(max_size);
-                wm.set.resize(c.total_chunks);
+            //xor of the parity and the rest of the group is the missing chunk.
+            //received short chunks are zero padded in data already
+            char* d = wm.data.data() + missing * chunk_size;
+            std::copy(parity, parity + chunk_size, d);
+            for(size_t n = start; n < end; n++)
+            {
+                if(n == missing) continue;
+                const char* o = wm.data.data() + n * chunk_size;
+                for(size_t i = 0; i < chunk_size; i++) d[i] ^= o[i];
             }
 
-            CHECK_GREATER(wm.proto.total_chunks, 0);
+            if(missing == total - 1) wm.last_size = size;
+            wm.set[missing] = 1;
+            rebuilt.push_back(missing);
+        }
+
+        size_t incoming_size(const message_chunk& c)
+        {
+            //zero if the header does not describe a message we take
+            if(c.total_chunks == 0) return 0;
+
+            //sender picks the chunk size from what the path can take
+            const size_t chunk_size = c.chunk_size;
+            if(chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) return 0;
+            if(c.fec > 0 && c.total_chunks < 2) return 0;
+
+            //the last chunk can be short, so allow one chunk over
+            const size_t max_size = c.total_chunks * chunk_size;
+            if(max_size > MAX_MESSAGE_SIZE + chunk_size) return 0;
+
+            return max_size + parity_groups(c.total_chunks, c.fec) * parity_size(c);
+        }
+
+        void init_incoming(const message_chunk& c, working_message& wm)
+        {
+            REQUIRE_GREATER(c.total_chunks, 0);
+
+            const size_t groups = parity_groups(c.total_chunks, c.fec);
+
+            wm.proto = c;
+            wm.proto.payload = nullptr;
+            wm.proto.payload_size = 0;
+            wm.data.resize(c.total_chunks * c.chunk_size);
+            wm.set.resize(c.total_chunks);
+            wm.parity.resize(groups * parity_size(c));
+            wm.parity_set.resize(groups);
+
+            ENSURE_EQUAL(wm.proto.total_chunks, c.total_chunks);
+        }
+
+        bool insert_chunk(
+                const message_chunk& c, 
+                working_message& wm, 
+                u::bytes& complete_message, 
+                chunk_ids& rebuilt)
+        {
+            REQUIRE(c.type == message_chunk::msg || c.type == message_chunk::qmsg);
+            REQUIRE_GREATER(wm.proto.total_chunks, 0);
 
             const auto chunk_n = c.chunk;
-            const auto sequence_n = c.sequence;
+            const size_t chunk_size = wm.proto.chunk_size;
+            const size_t total = wm.proto.total_chunks;
+            const size_t groups = parity_groups(total, wm.proto.fec);
 
-            if(chunk_n >= wm.proto.total_chunks) return false;
-            if(c.total_chunks != wm.proto.total_chunks) return false;
-            if(wm.set[chunk_n]) return false;
+            if(chunk_n >= total + groups) return false;
+            if(c.total_chunks != total) return false;
+            if(c.chunk_size != chunk_size) return false;
+            if(c.fec != wm.proto.fec) return false;
 
-            //potentially resize if we get the last message_chunk
-            if(c.chunk == wm.proto.total_chunks - 1)
+            size_t g = 0;
+            if(chunk_n >= total)
             {
-                auto extra = UDP_CHuNK_SIZE - c.data.size(); 
+                //parity is kept until its group is complete
+                g = chunk_n - total;
+                if(wm.parity_set[g]) return false;
+                if(c.payload_size != parity_size(wm.proto)) return false;
 
-                //should only shrink
-                CHECK_GREATER_EQUAL(extra, 0);
-                wm.data.resize(wm.data.size() - extra);
+                std::copy(c.payload, c.payload + c.payload_size, wm.parity.begin() + g * c.payload_size);
+                wm.parity_set[g] = 1;
             }
-            //only the last message_chunk can be less than the UDP_CHUNK_SIZE. Otherwise something is wrong
-            else if(c.data.size() != UDP_CHuNK_SIZE) return false;
-            
-            const size_t insert_spot = c.chunk * UDP_CHuNK_SIZE; 
-            std::copy(c.data.begin(), c.data.end(), wm.data.begin() + insert_spot); 
-            wm.set[chunk_n] = 1;
+            else
+            {
+                if(wm.set[chunk_n]) return false;
+
+                //only the last message_chunk can be less than the chunk size. Otherwise something is wrong
+                if(chunk_n == total - 1)
+                {
+                    if(c.payload_size > chunk_size) return false;
+                    wm.last_size = c.payload_size;
+                }
+                else if(c.payload_size != chunk_size) return false;
+
+                //payload goes straight from the datagram to its spot in the message
+                const size_t insert_spot = chunk_n * chunk_size; 
+                if(c.payload_size > 0)
+                    std::copy(c.payload, c.payload + c.payload_size, wm.data.begin() + insert_spot); 
+                wm.set[chunk_n] = 1;
+                if(groups > 0) g = chunk_n / wm.proto.fec;
+            }
+
+            if(groups > 0) rebuild(wm, g, rebuilt);
 
             //if message is not complete yet, return 
-            if(wm.set.count() != wm.proto.total_chunks) return false;
+            if(wm.set.count() != total) return false;
 
-            //return message
+            //return message, trimmed to the size of the last chunk
+            wm.data.resize((total - 1) * chunk_size + wm.last_size);
             complete_message = std::move(wm.data);
+            return true;
+        }
 
-            //remove message from working
-            w.erase(sequence_n);
+        void udp_connection::forget_incoming(incoming_messages::iterator i)
+        {
+            REQUIRE(i != _in_working.end());
+
+            auto& m = i->second;
+            auto p = _in_peers.find(i->first.ep);
+            CHECK(p != _in_peers.end());
+            CHECK_GREATER_EQUAL(p->second.bytes, m.bytes);
+            CHECK_GREATER_EQUAL(_in_bytes, m.bytes);
+
+            p->second.bytes -= m.bytes;
+            p->second.order.erase(m.peer_order);
+            if(p->second.order.empty()) _in_peers.erase(p);
+
+            _in_order.erase(m.order);
+            _in_bytes -= m.bytes;
+            _in_working.erase(i);
+
+            _stats.reassembly_bytes = _in_bytes;
+        }
+
+        bool udp_connection::make_room(const udp::endpoint& from, size_t bytes, udp_time now)
+        {
+            if(bytes > _in_peer_quota) return false;
+
+            //drop partial messages nothing has arrived for in a while,
+            //the sender gave up on them
+            while(!_in_order.empty())
+            {
+                auto i = _in_working.find(_in_order.front());
+                CHECK(i != _in_working.end());
+                if(now - i->second.wm.last_progress < REASSEMBLY_TIMEOUT) break;
+
+                forget_incoming(i);
+                _stats.evicted_stale++;
+            }
+
+            //a peer over its quota makes room from its own messages
+            for(auto p = _in_peers.find(from); 
+                    p != _in_peers.end() && p->second.bytes + bytes > _in_peer_quota; 
+                    p = _in_peers.find(from))
+            {
+                forget_incoming(_in_working.find(p->second.order.front()));
+                _stats.evicted_full++;
+            }
+
+            //then from whoever was least recently active
+            while(_in_bytes + bytes > _in_budget)
+            {
+                CHECK_FALSE(_in_order.empty());
+                forget_incoming(_in_working.find(_in_order.front()));
+                _stats.evicted_full++;
+            }
+
+            ENSURE_LESS_EQUAL(_in_bytes + bytes, _in_budget);
+            return true;
+        }
+
+        bool udp_connection::reassemble(
+                const udp::endpoint& from, 
+                const message_chunk& c, 
+                u::bytes& complete_message, 
+                chunk_ids& rebuilt,
+                bool prefixes)
+        {
+            const auto now = udp_clock::now();
+            const peer_sequence k{from, c.sequence};
+
+            auto i = _in_working.find(k);
+            if(i == _in_working.end())
+            {
+                const size_t bytes = incoming_size(c);
+                if(bytes == 0 || !make_room(from, bytes, now)) return false;
+
+                i = _in_working.emplace(k, incoming_message{}).first;
+                auto& m = i->second;
+                auto& p = _in_peers[from];
+                init_incoming(c, m.wm);
+                m.bytes = bytes;
+                m.order = _in_order.insert(_in_order.end(), k);
+                m.peer_order = p.order.insert(p.order.end(), k);
+                p.bytes += bytes;
+                _in_bytes += bytes;
+                _stats.reassembly_bytes = _in_bytes;
+            }
+            else
+            {
+                //most recently active moves to the back
+                auto& m = i->second;
+                auto& p = _in_peers[from];
+                _in_order.splice(_in_order.end(), _in_order, m.order);
+                p.order.splice(p.order.end(), p.order, m.peer_order);
+            }
+
+            auto& wm = i->second.wm;
+            wm.last_progress = now;
+            if(c.chunk < wm.set.size() && wm.set[c.chunk]) telemetry(from).duplicates++;
+
+            const bool complete = insert_chunk(c, wm, complete_message, rebuilt);
+            if(prefixes) hand_out_prefix(from, wm, complete ? complete_message : wm.data);
+            if(!complete) return false;
+
+            forget_incoming(i);
             return true;
         }
 
+        void udp_connection::hand_out_prefix(
+                const udp::endpoint& from, 
+                working_message& wm, 
+                const u::bytes& data)
+        {
+            REQUIRE(_prefix);
+
+            //chunks rebuilt from parity can extend the prefix by more than one
+            const size_t total = wm.proto.total_chunks;
+            size_t end = wm.prefix;
+            while(end < total && wm.set[end]) end++;
+            if(end == wm.prefix) return;
+
+            message_prefix p;
+            p.ep = { UDP, from.address().to_string(), from.port()};
+            p.sequence = wm.proto.sequence;
+            p.offset = wm.prefix * wm.proto.chunk_size;
+            p.last = end == total;
+
+            //data is trimmed once the message is complete
+            const size_t stop = p.last ? data.size() : end * wm.proto.chunk_size;
+            CHECK_LESS_EQUAL(stop, data.size());
+            p.data.assign(data.begin() + p.offset, data.begin() + stop);
+
+            wm.prefix = end;
+            _prefix(p);
+        }
+
+        bool single_chunk(const message_chunk& c)
+        {
+            //messages that fit in one chunk skip the working set
+            return c.total_chunks == 1 && c.chunk == 0 && 
+                c.payload_size > 0 && c.payload_size <= c.chunk_size &&
+                c.chunk_size >= MIN_CHUNK_SIZE && c.chunk_size <= MAX_CHUNK_SIZE;
+        }
+
         void udp_connection::handle_read(const boost::system::error_code& error, size_t transferred)
         {
             if(error)
@@ -643,183 +2486,253 @@ namespace fire
                 return;
             }
 
-            //get bytes
+            _stats.recv_calls++;
+            _stats.packets_recv++;
+
             CHECK_LESS_EQUAL(transferred, _in_buffer.size());
-            _work_buffer.resize(transferred);
-            std::copy(_in_buffer.begin(), _in_buffer.begin() + transferred, _work_buffer.begin());
+            handle_datagram(_in_buffer.data(), transferred, _in_endpoint);
+            start_read();
+        }
+
+        void udp_connection::handle_datagram(const char* data, size_t size, const udp::endpoint& from)
+        {
+            REQUIRE(data);
 
-            _stats.bytes_recv += transferred;
+            _stats.bytes_recv += size;
+            telemetry(from).bytes_recv += size;
 
-            //decode message
+            //decode header in place, the payload still points into data
             message_chunk c;
 
-            if(_work_buffer.size() >= HEADER_SIZE) 
-                c = decode_udp_wire(_work_buffer);
+            if(size >= LEGACY_HEADER_SIZE) 
+                c = decode_udp_wire(data, size);
+
+            if(!c.valid) return;
+
+            if(c.type == message_chunk::msg || c.type == message_chunk::qmsg)
+            { 
+                const bool robust = c.type == message_chunk::msg;
+
+                //acks are held back and sent together, parity is never acked
+                if(robust && c.chunk < c.total_chunks) queue_ack(from, c);
+
+                //already delivered, the sender just missed the ack or parity came late
+                if(_completed.count({from, c.sequence})) 
+                {
+                    telemetry(from).duplicates++;
+                    return;
+                }
 
-            if(c.valid)
-            {
                 //add message to in queue if we got complete message
-                endpoint ep = { UDP, _in_endpoint.address().to_string(), _in_endpoint.port()};
+                endpoint_message em{{ UDP, from.address().to_string(), from.port()}, {}, robust};
+                em.stream = c.stream;
 
-                if(c.type != message_chunk::ack)
-                { 
-                    const bool robust = c.type == message_chunk::msg;
-                    if(robust)
-                    {
-                        message_chunk ack;
-                        ack.type = message_chunk::ack;
-                        ack.host = ep.address;
-                        ack.port = ep.port;
-                        ack.sequence = c.sequence;
-                        ack.total_chunks = c.total_chunks;
-                        ack.chunk = c.chunk;
-                        CHECK(ack.data.empty());
-
-                        //send ack
-                        send_right_away(ack);
-                    }
+                //stream frames are only any use whole
+                const bool prefixes = _prefix && !c.stream;
 
-                    //insert message_chunk to message buffer
-                    bool inserted = insert_chunk(c, _in_working, _work_buffer);
-                    //message_chunk is no longer valid after insert_chunk call because a move is done.
+                bool complete = false;
+                if(single_chunk(c))
+                {
+                    em.data.assign(c.payload, c.payload + c.payload_size);
+                    complete = true;
 
-                    if(inserted)
+                    if(prefixes) 
                     {
-                        endpoint_message em{ep, _work_buffer, robust};
-                        _in_queue.emplace_push(em);
+                        message_prefix p{em.ep, c.sequence, 0, std::move(em.data), true};
+                        _prefix(p);
                     }
-
                 }
                 else 
                 {
-                    validate_chunk(c);
-                    post_send();
+                    chunk_ids rebuilt;
+                    complete = reassemble(from, c, em.data, rebuilt, prefixes);
+
+                    //rebuilt chunks are acked as if they arrived
+                    _stats.rebuilt += rebuilt.size();
+                    if(robust) for(auto n : rebuilt)
+                    {
+                        message_chunk r = c;
+                        r.chunk = n;
+                        queue_ack(from, r);
+                    }
                 }
 
-            }
-            start_read();
-        }
+                if(complete)
+                {
+                    if(!prefixes) 
+                    {
+                        if(_receive) _receive(em);
+                        else _in_queue.emplace_push(em);
+                    }
 
-        size_t udp_connection::resend(message_ring_item& r)
-        {
-            REQUIRE(r.wm);
-            auto &wm = *r.wm;
-            
-            REQUIRE_GREATER(wm.proto.total_chunks, 0);
-            REQUIRE_GREATER(wm.data.size(), 0);
+                    //remember messages that may still get chunks
+                    if(robust || c.fec > 0) add_completed({from, c.sequence});
 
-            if(wm.set.count() == wm.proto.total_chunks) return 0;
+                    //let the sender finish the message right away
+                    if(robust) flush_acks({from, c.sequence});
+                }
 
-            size_t resent_m = 0;
-            size_t cnt = 0;
-            for(chunk_id_type c = 0; c < wm.proto.total_chunks; c++)
+            }
+            else if(c.type == message_chunk::probe)
             {
-                if(cnt >= wm.next_send) break;
-                cnt++;
-                //skip validated or not sent
-                if(wm.set[c] || !wm.sent[c]) continue;
-                resent_m++;
-                if(resent_m > MAX_FLIGHT) break;
+                //tell the sender how much made it through
+                message_chunk r;
+                r.type = message_chunk::probe_ack;
+                r.ep = from;
+                r.sequence = c.sequence;
+                r.chunk = 0;
+                r.chunk_size = size;
+                send_right_away(r);
+            }
+            else 
+            {
+                //acks and probe replies go to the shard that sent the message
+                auto& o = owner(c.sequence);
+                if(&o == this)
+                {
+                    handle_ack(c, from);
+                    return;
+                }
 
-                _stats.dropped++;
-                queue_resend(r, c);
+                //the payload points into our read buffer, copy it to cross threads
+                message_chunk f = c;
+                if(c.payload) f.data.assign(c.payload, c.payload + c.payload_size);
+                f.payload = nullptr;
+                f.payload_size = 0;
+                o._io.post(boost::bind(&udp_connection::handle_forwarded, &o, f, from));
             }
-            return resent_m;
         }
 
-        void udp_connection::resend()
+        void udp_connection::handle_ack(const message_chunk& c, const udp::endpoint& from)
         {
-            bool resent = false;
-            exhausted_messages em;
-            for(auto& r : _message_ring)
+            if(c.type == message_chunk::probe_ack) probe_acked(from, c);
+            else 
             {
-                CHECK(r.wm);
-                auto& wm = *r.wm;
-                CHECK_GREATER(wm.proto.total_chunks, 0);
-
-                wm.ticks++;
-
-                sequence_type sequence = wm.proto.sequence;
-
-                //check if we should try to resend
-                bool skip = wm.ticks <= RESEND_TICK_THRESHOLD;
-                bool robust = wm.proto.type == message_chunk::msg;
+                validate_chunk(c);
+                post_send();
+            }
+        }
 
-                //walk working message and resend all chunks that never got
-                //acked
-                if(robust && !skip && resend(r) > 0) 
-                    resent = true;
+        void udp_connection::handle_forwarded(message_chunk c, udp::endpoint from)
+        {
+            c.payload = c.data.empty() ? nullptr : c.data.data();
+            c.payload_size = c.data.size();
+            handle_ack(c, from);
+        }
 
-                bool erase = robust ?  wm.ticks >= RESEND_THRESHOLD : all_sent(wm);
-                if(erase) em.insert(em.end(), sequence);
-            }
+        size_t udp_connection::shard_count() const
+        {
+            return _shards ? _shards->size() : 1;
+        }
 
-            for(auto sequence : em) cleanup_message(sequence);
+        udp_connection& udp_connection::owner(sequence_type s)
+        {
+            const size_t n = shard_count();
+            if(n == 1) return *this;
 
-            if(resent) post_send();
+            auto& o = (*_shards)[s % n];
+            CHECK(o);
+            return *o;
         }
 
-        const udp_stats& udp_connection::stats() const 
+        udp_stats udp_connection::stats() const 
         {
-            return _stats;
+            auto s = _stats;
+            auto p = std::atomic_load(&_peer_stats);
+            if(p) s.peers = *p;
+            return s;
         }
 
-        void udp_run_thread(udp_queue*);
-        void resend_thread(udp_queue*);
-        udp_queue::udp_queue(const asio_params& p) :
+        void udp_run_thread(udp_queue*, size_t);
+        udp_queue::udp_queue(const asio_params& p, receive_handler receive) :
             _p(p), 
-            _io{new ba::io_service},
+            _receive{receive},
             _done{false}
         {
             REQUIRE_GREATER(_p.local_port, 0);
-            _resolver.reset(new udp::resolver{*_io});
             bind();
-            _run_thread.reset(new std::thread{udp_run_thread, this});
-            _resend_thread.reset(new std::thread{resend_thread, this});
+            _resolver.reset(new udp::resolver{*_ios.front()});
+
+            for(size_t i = 0; i < _cons.size(); i++)
+                _run_threads.emplace_back(new std::thread{udp_run_thread, this, i});
 
-            INVARIANT(_io);
-            INVARIANT(_con);
+            INVARIANT_FALSE(_cons.empty());
+            INVARIANT_EQUAL(_ios.size(), _cons.size());
+            INVARIANT_EQUAL(_run_threads.size(), _cons.size());
             INVARIANT(_resolver);
-            INVARIANT(_run_thread);
-            INVARIANT(_resend_thread);
         }
 
         void udp_queue::bind()
         {
-            CHECK_FALSE(_con);
-            INVARIANT(_io);
+            CHECK(_cons.empty());
+
+            size_t shards = std::min(std::max<size_t>(_p.shards, 1), MAX_SHARDS);
+#ifndef FIRESTR_UDP_REUSEPORT
+            if(shards > 1) LOG << "udp shards need SO_REUSEPORT, using one socket" << std::endl;
+            shards = 1;
+#endif
+
+            //connections keep a pointer to their siblings, 
+            //so size the vector before creating any
+            _ios.resize(shards);
+            _cons.resize(shards);
+            for(size_t i = 0; i < shards; i++)
+            {
+                _ios[i].reset(new ba::io_service);
+                _cons[i].reset(new udp_connection{_in_queue, *_ios[i], i, &_cons, _p.upload_rate / shards, _p.reassembly_budget / shards, _p.uring, _receive});
+            }
 
-            _con = udp_connection_ptr{new udp_connection{_in_queue, *_io}};
-            _con->bind(_p.local_port);
+            for(auto& c : _cons) c->bind(_p.local_port);
             
-            ENSURE(_con);
+            ENSURE_EQUAL(_cons.size(), shards);
         }
 
         udp_queue::~udp_queue()
         {
-            INVARIANT(_io);
             _done = true;
-            _io->stop();
+            for(auto& io : _ios) io->stop();
             if(_p.block) _in_queue.done();
             if(_p.wait > 0) u::sleep_thread(_p.wait);
-            if(_con) _con->close();
-            if(_run_thread) _run_thread->join();
-            if(_resend_thread) _resend_thread->join();
+            for(auto& c : _cons) c->close();
+            for(auto& t : _run_threads) t->join();
+        }
+
+        udp_connection& udp_queue::shard_for(const endpoint& ep)
+        {
+            REQUIRE_FALSE(_cons.empty());
+
+            //all messages to a peer go through one shard, which keeps its
+            //congestion and mtu state
+            const size_t h = std::hash<std::string>{}(ep.address) ^ ep.port;
+            return *_cons[h % _cons.size()];
         }
 
         bool udp_queue::send(const endpoint_message& m)
         {
-            INVARIANT(_io);
-            CHECK(_con);
+            INVARIANT_FALSE(_cons.empty());
+
+            const auto& address = resolve(m.ep);
+            if(address != m.ep.address)
+            {
+                endpoint_message cm = m;
+                cm.ep.address = address;
+                return shard_for(cm.ep).send(cm, _p.block);
+            }
+            return shard_for(m.ep).send(m, _p.block);
+        }
+
+        send_status udp_queue::try_send(const endpoint_message& m)
+        {
+            INVARIANT_FALSE(_cons.empty());
 
             const auto& address = resolve(m.ep);
             if(address != m.ep.address)
             {
                 endpoint_message cm = m;
                 cm.ep.address = address;
-                return _con->send(cm, _p.block);
+                return shard_for(cm.ep).try_send(cm);
             }
-            return _con->send(m, _p.block);
+            return shard_for(m.ep).try_send(m);
         }
 
         const std::string& udp_queue::resolve(const endpoint& ep)
@@ -844,41 +2757,44 @@ namespace fire
             return _in_queue.pop(m, _p.block);
         }
 
-        const udp_stats& udp_queue::stats() const 
+        udp_stats udp_queue::stats() const 
         {
-            CHECK(_con);
-            return _con->stats();
+            udp_stats s;
+            for(const auto& c : _cons) s += c->stats();
+            return s;
         }
 
-        void udp_run_thread(udp_queue* q)
+        void udp_queue::on_prefix(prefix_handler h)
         {
-            CHECK(q);
-            CHECK(q->_io);
-            while(!q->_done) 
-            try
-            {
-                q->_io->run();
-                u::sleep_thread(THREAD_SLEEP);
-            }
-            catch(std::exception& e)
+            for(auto& c : _cons) 
             {
-                LOG << "error in udp thread. " << e.what() << std::endl;
+                CHECK(c);
+                c->on_prefix(h);
             }
-            catch(...)
+        }
+
+        peer_windows udp_queue::windows() const
+        {
+            peer_windows r;
+            for(const auto& c : _cons) 
             {
-                LOG << "unknown error in udp thread." << std::endl;
+                auto w = c->windows();
+                r.insert(w.begin(), w.end());
             }
+            return r;
         }
 
-        void resend_thread(udp_queue* q)
+        void udp_run_thread(udp_queue* q, size_t shard)
         {
             CHECK(q);
-            CHECK(q->_io);
+            CHECK_RANGE(shard, 0, q->_ios.size());
+
+            auto& io = *q->_ios[shard];
             while(!q->_done) 
             try
             {
-                q->_io->post(boost::bind(&udp_connection::resend, q->_con));
-                u::sleep_thread(RESEND_THREAD_SLEEP);
+                io.run();
+                u::sleep_thread(THREAD_SLEEP);
             }
             catch(std::exception& e)
             {
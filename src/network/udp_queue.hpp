@@ -34,10 +34,24 @@
 #include "network/util.hpp"
 #include "network/connection.hpp"
 #include "network/message_queue.hpp"
+#include "network/udp_ring.hpp"
 #include "util/thread.hpp"
 
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <list>
+#include <queue>
 #include <unordered_map>
+#include <unordered_set>
+
+//batch datagrams with sendmmsg/recvmmsg where the platform has them,
+//and spread receive over several sockets on one port with SO_REUSEPORT
+#ifdef __linux__
+#define FIRESTR_UDP_MMSG
+#define FIRESTR_UDP_REUSEPORT
+#endif
 
 namespace fire
 {
@@ -45,9 +59,15 @@ namespace fire
     {
         struct endpoint_message
         {
+            //classes share the upload by weight, realtime the most
+            enum priority_class { realtime, interactive, bulk };
+
             endpoint ep;
             util::bytes data;
             bool robust;
+            size_t fec = 0; //chunks per parity chunk, 0 turns error correction off
+            priority_class priority = interactive;
+            bool stream = false; //carries a stream frame, see stream.hpp
         };
 
         using endpoint_queue = util::queue<endpoint_message>;
@@ -57,113 +77,543 @@ namespace fire
         using sequence_type = uint64_t;
         using chunk_total_type = uint16_t;
         using chunk_id_type = uint16_t;
+        using chunk_size_type = uint16_t;
+        using fec_type = uint8_t;
+        using chunk_ids = std::vector<chunk_id_type>;
+        using udp_clock = std::chrono::steady_clock;
+        using udp_time = udp_clock::time_point;
 
         struct message_chunk
         {
             bool valid = false;
-            std::string host;
-            port_type port = 0;
+            boost::asio::ip::udp::endpoint ep; //resolved once per message, copied without allocating
             sequence_type sequence = 0;
             chunk_total_type total_chunks = 0;
             chunk_id_type chunk;
+            chunk_size_type chunk_size = 0;
+            fec_type fec = 0;
             util::bytes data;
             bool resent = false;
-            enum msg_type { qmsg, msg, ack} type;
-
-            //used for writing
-            const char* write_data = nullptr;
-            size_t write_size = 0;
+            bool stream = false; //part of a stream frame, always robust
+            bool legacy = false; //in the wire format from before chunk sizes and parity
+            enum msg_type { qmsg, msg, ack, sack, probe, probe_ack} type;
+
+            //payload borrowed from the message being sent 
+            //or the datagram being read, used instead of data
+            const char* payload = nullptr;
+            size_t payload_size = 0;
         };
 
 
         struct working_message
         {
             message_chunk proto;
+            boost::asio::ip::udp::endpoint ep;
             util::bytes data;
             boost::dynamic_bitset<> set;
             boost::dynamic_bitset<> sent;
-            size_t ticks = 0;
             size_t in_flight = 0;
             size_t queued = 0;
             size_t next_send = 0;
+
+            //retransmission state for robust messages
+            std::vector<udp_time> sent_at;
+            std::vector<udp_time> deadline;
+            std::vector<uint8_t> skipped;
+            boost::dynamic_bitset<> resent;
+            size_t lowest_unacked = 0;
+            udp_time last_progress;
+
+            //xor parity per group of proto.fec chunks, numbered after the data chunks
+            util::bytes parity;
+            boost::dynamic_bitset<> parity_set;
+            size_t next_parity = 0;
+            size_t last_size = 0;
+
+            size_t prefix = 0; //chunks from the start already handed out
+        };
+
+        struct udp_endpoint_hash
+        {
+            size_t operator()(const boost::asio::ip::udp::endpoint&) const;
         };
 
-        //working set for both incoming and outgoing messages
         using hash_type = std::size_t;
-        using working_messages = std::unordered_map<sequence_type, working_message>;
         using resolve_map = std::unordered_map<std::string, std::string>;
 
-        //outgoing chunks are send round robin in the message_ring
-        using chunk_id_queue = util::queue<chunk_id_type>;
+        //outgoing messages live in slots of the message_ring. a handle to a slot 
+        //stays valid until the message is removed, after which the slot 
+        //generation no longer matches.
+        struct message_handle
+        {
+            size_t slot = 0;
+            size_t generation = 0;
+        };
+
+        using chunk_id_queue = std::deque<chunk_id_type>;
         struct message_ring_item
         {
-            working_message* wm;
+            working_message wm;
             chunk_id_queue resends; 
+            message_handle handle;
+            bool used = false;
+        };
+
+        class message_ring
+        {
+            public:
+                message_ring_item& add(sequence_type);
+                void remove(message_ring_item&);
+                message_ring_item* find(sequence_type);
+                message_ring_item* get(const message_handle&);
+                bool empty() const;
+                size_t size() const;
+
+            private:
+                std::deque<message_ring_item> _slots;
+                std::vector<size_t> _free;
+                std::unordered_map<sequence_type, message_handle> _index;
+                size_t _size = 0;
+        };
+
+        //messages of one priority class going to one peer, sent round robin.
+        //handles of removed messages are dropped when the flow gets to them
+        struct udp_flow
+        {
+            boost::asio::ip::udp::endpoint ep;
+            std::deque<message_handle> messages;
+            long deficit = 0; //in bytes
+        };
+
+        using udp_flows = std::list<udp_flow>;
+        using udp_flow_index = std::unordered_map<
+            boost::asio::ip::udp::endpoint, 
+            udp_flows::iterator, 
+            udp_endpoint_hash>;
+
+        //deficit round robin over the classes, and within a class over the peers
+        struct udp_class
+        {
+            udp_flows flows;
+            udp_flow_index index;
+            long deficit = 0; //in bytes
+        };
+
+        const size_t PRIORITY_CLASSES = 3;
+        using udp_classes = std::array<udp_class, PRIORITY_CLASSES>;
+
+        //bytes allowed out right away, refilled at the rate up to the burst.
+        //rate is in bytes per millisecond, 0 means no limit
+        struct token_bucket
+        {
+            double rate = 0;
+            double burst = 0;
+            double tokens = 0;
+            udp_time filled;
+        };
+
+        //congestion window, in chunks, and rtt estimate kept per remote endpoint.
+        //times are in milliseconds
+        struct udp_peer
+        {
+            double window = 0;
+            double threshold = 0;
+            size_t in_flight = 0;
+            udp_time recover_until;
+
+            bool has_rtt = false;
+            double srtt = 0;
+            double min_rtt = 0;
+            double rttvar = 0;
+            double rto = 0;
+
+            //spreads a window of chunks over a round trip instead of one burst
+            token_bucket pace;
+
+            //path mtu discovery. sizes are whole udp payloads in bytes
+            enum probe_state { unprobed, probing, probed } probe = unprobed;
+            size_t packet_size = 0;
+            size_t probe_rung = 0;
+            size_t probe_tries = 0;
+            sequence_type probe_id = 0;
+            udp_time probe_deadline;
+            size_t timeouts = 0;
+
+            //older peers drop probes, so until one is answered 
+            //messages go out in the legacy wire format
+            bool legacy = true;
+
+            udp_time used; //last looked up, idle peers are forgotten
+        };
+
+        //a chunk to resend if it is not acked by the deadline
+        struct resend_timeout
+        {
+            udp_time deadline;
+            message_handle message;
+            chunk_id_type chunk;
+
+            bool operator>(const resend_timeout& o) const { return deadline > o.deadline;}
+        };
+
+        using resend_timeouts = std::priority_queue<
+            resend_timeout, 
+            std::vector<resend_timeout>, 
+            std::greater<resend_timeout>>;
+
+        using udp_peers = std::unordered_map<boost::asio::ip::udp::endpoint, udp_peer, udp_endpoint_hash>;
+
+        //message sequences are only unique per sender
+        struct peer_sequence
+        {
+            boost::asio::ip::udp::endpoint ep;
+            sequence_type sequence;
+
+            bool operator==(const peer_sequence& o) const 
+            { 
+                return sequence == o.sequence && ep == o.ep;
+            }
+        };
+
+        struct peer_sequence_hash
+        {
+            size_t operator()(const peer_sequence&) const;
+        };
+
+        //partial incoming messages live within a memory budget. the least recently 
+        //active go first, and a peer over its quota makes room from its own
+        using peer_sequence_order = std::list<peer_sequence>;
+        struct incoming_message
+        {
+            working_message wm;
+            size_t bytes = 0;
+            peer_sequence_order::iterator order;
+            peer_sequence_order::iterator peer_order;
         };
 
-        using message_ring = std::vector<message_ring_item>;
+        using incoming_messages = std::unordered_map<peer_sequence, incoming_message, peer_sequence_hash>;
+
+        struct reassembly_peer
+        {
+            size_t bytes = 0;
+            peer_sequence_order order;
+        };
+
+        using reassembly_peers = std::unordered_map<
+            boost::asio::ip::udp::endpoint, 
+            reassembly_peer, 
+            udp_endpoint_hash>;
+
+        //received chunks waiting to be acked together
+        struct pending_ack
+        {
+            chunk_total_type total_chunks = 0;
+            chunk_ids chunks;
+            bool legacy = false; //acked one chunk at a time
+        };
+
+        using pending_acks = std::unordered_map<peer_sequence, pending_ack, peer_sequence_hash>;
+
+        //robust messages recently delivered. chunks resent after a lost ack
+        //are acked again but the message is not delivered twice
+        using completed_messages = std::unordered_set<peer_sequence, peer_sequence_hash>;
+        using completed_order = std::deque<peer_sequence>;
+        using peer_windows = std::unordered_map<std::string, size_t>;
+
+        //transport health with one remote endpoint. 
+        //times are in milliseconds, rates in bytes per second
+        struct udp_peer_stats
+        {
+            double srtt = 0;
+            double min_rtt = 0;
+            double loss = 0; //share of chunks sent that were lost, averaged over time
+            size_t resent = 0;
+            size_t duplicates = 0; //chunks that arrived when they were no longer needed
+            size_t in_flight = 0;
+            size_t window = 0;
+            size_t reassembly_bytes = 0;
+            double send_rate = 0;
+            double recv_rate = 0;
+
+            udp_peer_stats& operator+=(const udp_peer_stats&);
+        };
+
+        using udp_peer_stats_table = std::unordered_map<std::string, udp_peer_stats>;
+        using udp_peer_stats_ptr = std::shared_ptr<const udp_peer_stats_table>;
 
         struct udp_stats
         {
             size_t dropped = 0;
+            size_t rebuilt = 0; //chunks recovered from parity instead of resent
+
+            //partial incoming messages
+            size_t reassembly_bytes = 0;
+            size_t evicted_stale = 0; //nothing arrived for them in a while
+            size_t evicted_full = 0; //made room for newer ones
+            size_t bytes_sent = 0;
+            size_t bytes_recv = 0;
+
+            //datagrams and the syscalls used to move them
+            size_t packets_sent = 0;
+            size_t packets_recv = 0;
+            size_t send_calls = 0;
+            size_t recv_calls = 0;
+
+            //by address, from a snapshot the socket thread takes every half second
+            udp_peer_stats_table peers;
+
+            double packets_per_send() const;
+            double packets_per_recv() const;
+            udp_stats& operator+=(const udp_stats&);
+        };
+
+        //counts per remote endpoint kept on the socket thread, turned into udp_peer_stats
+        struct peer_telemetry
+        {
             size_t bytes_sent = 0;
             size_t bytes_recv = 0;
+            size_t chunks_sent = 0; //of robust messages, resends included
+            size_t lost = 0;
+            size_t resent = 0;
+            size_t duplicates = 0;
+
+            //as of the last snapshot
+            size_t snap_bytes_sent = 0;
+            size_t snap_bytes_recv = 0;
+            size_t snap_chunks_sent = 0;
+            size_t snap_lost = 0;
+            size_t idle = 0; //snapshots in a row without traffic
+
+            double loss = 0;
+            double send_rate = 0;
+            double recv_rate = 0;
+        };
+
+        using peer_telemetries = std::unordered_map<
+            boost::asio::ip::udp::endpoint, 
+            peer_telemetry, 
+            udp_endpoint_hash>;
+
+        //datagrams encoded and ready to hand to the socket in one call
+        struct datagram_batch
+        {
+            std::vector<util::bytes> data;
+            std::vector<boost::asio::ip::udp::endpoint> eps;
+            size_t start = 0;
+            size_t size = 0;
         };
 
         using chunk_queue = util::queue<message_chunk>;
 
+        //start of a message that arrived in order, handed out before the rest
+        struct message_prefix
+        {
+            endpoint ep;
+            sequence_type sequence = 0;
+            size_t offset = 0; //of data in the message
+            util::bytes data;
+            bool last = false; //data ends the message
+        };
+
+        //called on the socket thread, so it should be quick or hand the data off
+        using prefix_handler = std::function<void(message_prefix&)>;
+        using receive_handler = std::function<void(endpoint_message&)>;
+
         class udp_queue;
+        class udp_connection;
+        using udp_connection_ptr = std::shared_ptr<udp_connection>;
+        using udp_connections = std::vector<udp_connection_ptr>;
+        using asio_services = std::vector<asio_service_ptr>;
+        using udp_threads = std::vector<util::thread_uptr>;
+
         class udp_connection
         {
             public:
                 udp_connection(
                         endpoint_queue& in,
-                        boost::asio::io_service& io);
+                        boost::asio::io_service& io,
+                        size_t shard = 0,
+                        const udp_connections* shards = nullptr,
+                        size_t upload_rate = 0,
+                        size_t reassembly_budget = 0,
+                        bool uring = false,
+                        receive_handler receive = {});
             public:
                 bool send(const endpoint_message& m, bool block = false);
+                send_status try_send(const endpoint_message& m);
 
             public:
                 void bind(port_type port);
                 void do_send();
                 void handle_write(const boost::system::error_code& error);
                 void handle_read(const boost::system::error_code& error, size_t transferred);
+                void handle_writable(const boost::system::error_code& error);
+                void handle_readable(const boost::system::error_code& error);
                 void close();
                 void start_read();
                 void do_close();
-                const udp_stats& stats() const; 
+                udp_stats stats() const; 
+                peer_windows windows() const;
+                void on_prefix(prefix_handler);
 
             private:
+                void queue_message(const endpoint_message& m);
                 void add_to_working_set(endpoint_message m);
-                void init_working(message_chunk& proto, util::bytes& data);
+                void init_working(message_chunk& proto, util::bytes& data, endpoint_message::priority_class);
                 void send_right_away(message_chunk& c);
                 bool get_next_chunk(working_message&, message_chunk& queued_chunk);
-                void cleanup_message(sequence_type sequence);
+                void cleanup_message(message_ring_item&);
                 void validate_chunk(const message_chunk& c);
                 void queue_resend(message_ring_item&, chunk_id_type c);
                 void queue_next_chunk();
-                bool incr_next_message();
+                bool next_class_chunk(udp_class&, message_chunk&);
+                bool next_flow_chunk(udp_flow&, message_chunk&);
+                bool paced(token_bucket&, udp_time now);
+                void schedule_pace(udp_time deadline);
+                void handle_pace_timer(const boost::system::error_code& error);
                 void sent_chunk(const message_chunk& c);
-                size_t resend(message_ring_item&);
-                void resend();
+                void resent_chunk(const message_chunk& c);
+                void purge_stalled(udp_time now);
                 void post_send();
+                udp_peer& peer(const boost::asio::ip::udp::endpoint&);
+                udp_peer* find_peer(const boost::asio::ip::udp::endpoint&);
+                void forget_idle_peers(udp_time now);
+                void window_acked(udp_peer&);
+                void window_lost(udp_peer&, bool timeout);
+                void update_rtt(udp_peer&, double sample);
+                void arm_resend(message_ring_item&, chunk_id_type, udp_time deadline);
+                void fast_resend(message_ring_item&, chunk_id_type acked);
+                bool acked(message_ring_item&, size_t chunk, udp_time now, double& rtt);
+                void queue_ack(const boost::asio::ip::udp::endpoint&, const message_chunk&);
+                void send_acks(const peer_sequence&, pending_ack&);
+                void flush_acks(const peer_sequence&);
+                void handle_ack_timer(const boost::system::error_code& error);
+                void add_completed(const peer_sequence&);
+                void schedule_resend();
+                void handle_resend_timer(const boost::system::error_code& error);
+                void start_probe(udp_peer&, const boost::asio::ip::udp::endpoint&);
+                void send_probe(udp_peer&, const boost::asio::ip::udp::endpoint&);
+                void schedule_probe(udp_time deadline);
+                void handle_probe_timer(const boost::system::error_code& error);
+                peer_telemetry& telemetry(const boost::asio::ip::udp::endpoint&);
+                void schedule_stats();
+                void handle_stats_timer(const boost::system::error_code& error);
+                void publish_stats(udp_time now);
+                void probe_acked(const boost::asio::ip::udp::endpoint&, const message_chunk&);
+                void packet_too_big(const boost::asio::ip::udp::endpoint&);
+                void send_one();
+                void handle_datagram(const char* data, size_t size, const boost::asio::ip::udp::endpoint& from);
+                bool reassemble(
+                        const boost::asio::ip::udp::endpoint& from, 
+                        const message_chunk&, 
+                        util::bytes& complete_message, 
+                        chunk_ids& rebuilt,
+                        bool prefixes);
+                void hand_out_prefix(
+                        const boost::asio::ip::udp::endpoint& from, 
+                        working_message&, 
+                        const util::bytes& data);
+                void set_prefix_handler(prefix_handler);
+                bool make_room(const boost::asio::ip::udp::endpoint& from, size_t bytes, udp_time now);
+                void forget_incoming(incoming_messages::iterator);
+                void handle_ack(const message_chunk&, const boost::asio::ip::udp::endpoint& from);
+                udp_connection& owner(sequence_type);
+                void handle_forwarded(message_chunk c, boost::asio::ip::udp::endpoint from);
+                size_t shard_count() const;
+#ifdef FIRESTR_UDP_MMSG
+                void send_batch();
+                bool fill_batch();
+                bool flush_batch();
+                void read_batch();
+#endif
+#ifdef FIRESTR_UDP_URING
+                void send_ring();
+                void ring_sent(size_t slot, int result);
+                void handle_ring(const boost::system::error_code& error);
+                bool start_ring();
+                void arm_ring();
+                void drop_ring();
+#endif
 
             private:
                 //reading
-                util::bytes _work_buffer;
                 util::bytes _in_buffer;
                 util::bytes _out_buffer;
                 boost::asio::ip::udp::endpoint _in_endpoint;
-                working_messages _in_working;
-                working_messages _out_working;
+                incoming_messages _in_working;
+                peer_sequence_order _in_order; //least recently active first
+                reassembly_peers _in_peers;
+                size_t _in_bytes = 0;
+                size_t _in_budget; //bytes of partial messages, one of the largest when none is given
+                size_t _in_peer_quota; //of _in_budget one peer may hold
                 endpoint_queue& _in_queue;
+                receive_handler _receive; //when set, whole messages go here instead of _in_queue
+                prefix_handler _prefix; //when set, messages go here in pieces instead of _in_queue
 
                 //writing
-                size_t _next_message = 0;
                 message_ring _message_ring; //messages get chunked to here
+                send_budget _budget; //bytes of messages not done sending
+                udp_classes _classes;
+                size_t _class_turn = 0;
 
                 //queue for chunks ready to go
                 chunk_queue _out_queue; //the queue loop adds next message to here to be sent
 
+                //congestion control
+                udp_peers _peers;
+                mutable std::mutex _peer_mutex;
+
+                //retransmission
+                resend_timeouts _resend_timeouts;
+                boost::asio::steady_timer _resend_timer;
+                udp_time _resend_timer_deadline;
+                bool _resend_timer_armed = false;
+
+                //delayed acks
+                pending_acks _pending_acks;
+                boost::asio::steady_timer _ack_timer;
+                bool _ack_timer_armed = false;
+                completed_messages _completed;
+                completed_order _completed_order;
+
+                //pacing, the upload bucket caps the socket as a whole
+                token_bucket _upload;
+                boost::asio::steady_timer _pace_timer;
+                udp_time _pace_timer_deadline;
+                bool _pace_timer_armed = false;
+
+                //path mtu probes
+                boost::asio::steady_timer _probe_timer;
+                udp_time _probe_timer_deadline;
+                bool _probe_timer_armed = false;
+                sequence_type _probe_id = 0;
+
+                //per peer stats, published for other threads as a snapshot
+                peer_telemetries _telemetry;
+                peer_telemetry _untracked; //counts for peers past the table size
+                udp_peer_stats_ptr _peer_stats;
+                boost::asio::steady_timer _stats_timer;
+                udp_time _stats_at;
+
+#ifdef FIRESTR_UDP_MMSG
+                //batched io
+                bool _batched = true;
+                datagram_batch _out_batch;
+                datagram_batch _in_batch;
+#endif
+
+#ifdef FIRESTR_UDP_URING
+                //the batch above goes through the ring when the kernel allows it
+                bool _use_ring = false;
+                udp_ring_ptr _ring;
+                size_t _ring_next = 0; //slot of the batch the ring takes next
+#endif
+
+                //sockets sharing the port. sequences and probe ids are 
+                //congruent to the shard id so acks find their way back
+                size_t _shard = 0;
+                const udp_connections* _shards = nullptr;
+
                 //other
                 boost::asio::io_service& _io;
                 udp_socket_ptr _socket;
@@ -172,50 +622,49 @@ namespace fire
                 boost::system::error_code _error;
                 udp_stats _stats;
             private:
-                friend void udp_run_thread(udp_queue*);
-                friend void resend_thread(udp_queue*);
+                friend void udp_run_thread(udp_queue*, size_t);
         };
 
-        using udp_connection_ptr = std::shared_ptr<udp_connection>;
-        using udp_connections = std::vector<udp_connection_ptr>;
-
         class udp_queue
         {
             public:
-                udp_queue(const asio_params& p);
+                udp_queue(const asio_params& p, receive_handler receive = {});
                 virtual ~udp_queue();
 
             public:
                 virtual bool send(const endpoint_message& m);
+                virtual send_status try_send(const endpoint_message& m);
                 virtual bool receive(endpoint_message& b);
 
             public:
-                const udp_stats& stats() const; 
+                udp_stats stats() const; 
+                peer_windows windows() const;
+                void on_prefix(prefix_handler);
 
             private:
                 void bind();
                 const std::string& resolve(const endpoint&);
+                udp_connection& shard_for(const endpoint&);
 
             private:
                 asio_params _p;
-                asio_service_ptr _io;
-                util::thread_uptr _run_thread;
-                util::thread_uptr _resend_thread;
+                asio_services _ios;
+                udp_threads _run_threads;
 
-                udp_connection_ptr _con;
+                udp_connections _cons;
                 endpoint_queue _in_queue;
+                receive_handler _receive;
                 udp_resolver_ptr _resolver;
                 resolve_map _rmap;
                 bool _done;
 
             private:
-                friend void udp_run_thread(udp_queue*);
-                friend void resend_thread(udp_queue*);
+                friend void udp_run_thread(udp_queue*, size_t);
         };
 
         using udp_queue_ptr = std::shared_ptr<udp_queue>;
 
-        udp_queue_ptr create_udp_queue(const asio_params& c);
+        udp_queue_ptr create_udp_queue(const asio_params& c, receive_handler receive = {});
     }
 }
 
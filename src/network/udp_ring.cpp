@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/udp_ring.hpp"
+
+#ifdef FIRESTR_UDP_URING
+
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ba = boost::asio;
+using namespace boost::asio::ip;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const unsigned RING_ENTRIES = 256;
+            const unsigned RING_CQ_ENTRIES = 4096; //multishot receive posts one per datagram
+            const unsigned RECV_BUFFERS = 512; //power of two
+            const unsigned short RECV_GROUP = 0;
+            const uint64_t RECV_TAG = ~uint64_t(0); //user data of the receive, sends use their slot
+            const uint64_t CANCEL_TAG = ~uint64_t(1);
+            const int DRAIN_WAIT = 100; //ms to wait on completions when closing
+            const size_t DRAIN_TRIES = 20; //waits before giving up on requests that will not finish
+
+            int ring_setup(unsigned entries, io_uring_params* p)
+            {
+                return syscall(__NR_io_uring_setup, entries, p);
+            }
+
+            int ring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+            {
+                return syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0);
+            }
+
+            int ring_register(int fd, unsigned op, void* arg, unsigned n)
+            {
+                return syscall(__NR_io_uring_register, fd, op, arg, n);
+            }
+
+            template <class T>
+                T load_acquire(const T* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE);}
+
+            template <class T>
+                void store_release(T* p, T v) { __atomic_store_n(p, v, __ATOMIC_RELEASE);}
+
+            template <class T>
+                T* at(void* base, size_t offset) { return reinterpret_cast<T*>(static_cast<char*>(base) + offset);}
+        }
+
+        udp_ring::udp_ring(
+                ba::io_service& io, 
+                int socket, 
+                size_t max_datagram,
+                size_t send_slots,
+                ring_datagram_handler on_datagram,
+                ring_sent_handler on_sent) :
+            _socket{socket},
+            _send_msgs(send_slots),
+            _send_iovs(send_slots),
+            _event{io},
+            _on_datagram{on_datagram},
+            _on_sent{on_sent}
+        {
+            REQUIRE_GREATER_EQUAL(socket, 0);
+            REQUIRE_GREATER(send_slots, 0);
+            REQUIRE_LESS(send_slots, RING_ENTRIES);
+            REQUIRE(on_datagram);
+            REQUIRE(on_sent);
+
+            _ok = setup() && supported_ops() && setup_buffers(max_datagram);
+            if(_ok) return;
+
+            LOG << "io_uring unavailable for udp: " << std::strerror(errno) << std::endl;
+            unmap();
+        }
+
+        udp_ring::~udp_ring()
+        {
+            close();
+            unmap();
+        }
+
+        bool udp_ring::setup()
+        {
+            io_uring_params p;
+            std::memset(&p, 0, sizeof(p));
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = RING_CQ_ENTRIES;
+
+            _fd = ring_setup(RING_ENTRIES, &p);
+            if(_fd < 0) return false;
+
+            //one mapping for both rings, and completions are never dropped
+            const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+            if((p.features & needed) != needed) 
+            {
+                errno = ENOSYS;
+                return false;
+            }
+
+            _rings_size = std::max(
+                    p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                    p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+            _rings = mmap(nullptr, _rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+            if(_rings == MAP_FAILED) 
+            {
+                _rings = nullptr;
+                return false;
+            }
+
+            _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            void* sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+            if(sqes == MAP_FAILED) return false;
+            _sqes = static_cast<io_uring_sqe*>(sqes);
+
+            _sq_head = at<unsigned>(_rings, p.sq_off.head);
+            _sq_tail = at<unsigned>(_rings, p.sq_off.tail);
+            _sq_flags = at<unsigned>(_rings, p.sq_off.flags);
+            _sq_array = at<unsigned>(_rings, p.sq_off.array);
+            _sq_mask = *at<unsigned>(_rings, p.sq_off.ring_mask);
+            _sq_entries = p.sq_entries;
+            _sq_local_tail = _sq_submitted = *_sq_tail;
+
+            _cq_head = at<unsigned>(_rings, p.cq_off.head);
+            _cq_tail = at<unsigned>(_rings, p.cq_off.tail);
+            _cqes = at<io_uring_cqe>(_rings, p.cq_off.cqes);
+            _cq_mask = *at<unsigned>(_rings, p.cq_off.ring_mask);
+
+            //completions wake the io_service through an eventfd
+            int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(efd < 0) return false;
+            _event.assign(efd);
+            return ring_register(_fd, IORING_REGISTER_EVENTFD, &efd, 1) == 0;
+        }
+
+        bool udp_ring::supported_ops()
+        {
+            const size_t ops = IORING_OP_LAST;
+            std::vector<char> mem(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op), 0);
+            auto* probe = reinterpret_cast<io_uring_probe*>(mem.data());
+            if(ring_register(_fd, IORING_REGISTER_PROBE, probe, ops) < 0) return false;
+
+            for(auto op : {IORING_OP_RECVMSG, IORING_OP_SENDMSG})
+                if(op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                {
+                    errno = ENOSYS;
+                    return false;
+                }
+            return true;
+        }
+
+        bool udp_ring::setup_buffers(size_t max_datagram)
+        {
+            REQUIRE_GREATER(max_datagram, 0);
+
+            //each buffer takes the receive header, the sender address, and the datagram
+            _buffer_size = sizeof(io_uring_recvmsg_out) + udp::endpoint{}.capacity() + max_datagram;
+            _buffer_size = (_buffer_size + 63) & ~size_t(63);
+
+            _buf_ring_size = RECV_BUFFERS * sizeof(io_uring_buf);
+            void* r = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(r == MAP_FAILED) return false;
+            _buf_ring = static_cast<io_uring_buf_ring*>(r);
+
+            _buffers_size = RECV_BUFFERS * _buffer_size;
+            void* b = mmap(nullptr, _buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(b == MAP_FAILED) return false;
+            _buffers = static_cast<char*>(b);
+
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+            reg.ring_entries = RECV_BUFFERS;
+            reg.bgid = RECV_GROUP;
+            if(ring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return false;
+
+            _buf_tail = 0;
+            for(unsigned short i = 0; i < RECV_BUFFERS; i++) recycle(i);
+            publish_buffers();
+
+            std::memset(&_recv_msg, 0, sizeof(_recv_msg));
+            _recv_msg.msg_namelen = udp::endpoint{}.capacity();
+            return true;
+        }
+
+        void udp_ring::unmap()
+        {
+            if(_buffers) munmap(_buffers, _buffers_size);
+            if(_buf_ring) munmap(_buf_ring, _buf_ring_size);
+            if(_sqes) munmap(_sqes, _sqes_size);
+            if(_rings) munmap(_rings, _rings_size);
+            _buffers = nullptr;
+            _buf_ring = nullptr;
+            _sqes = nullptr;
+            _rings = nullptr;
+        }
+
+        void udp_ring::close()
+        {
+            //the kernel keeps writing into the receive buffers until the receive
+            //is cancelled. if it never finishes the buffers are left mapped, 
+            //sends only read memory so they can do no harm
+            if(!drain())
+            {
+                LOG << "io_uring udp requests did not finish, leaving receive buffers mapped" << std::endl;
+                _buffers = nullptr;
+                _buf_ring = nullptr;
+            }
+
+            boost::system::error_code ec;
+            _event.close(ec);
+            if(_fd >= 0) ::close(_fd);
+            _fd = -1;
+            _ok = false;
+        }
+
+        bool udp_ring::drain()
+        {
+            if(_fd < 0 || !_rings) return true;
+
+            bool cancelling = false;
+            for(size_t tries = 0; _in_flight > 0; )
+            {
+                if(!cancelling)
+                {
+                    auto* sqe = next_sqe();
+                    if(sqe)
+                    {
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->fd = -1;
+                        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+                        sqe->user_data = CANCEL_TAG;
+                        cancelling = true;
+                    }
+                }
+
+                //what was never submitted goes in with the cancel, which is last in line
+                store_release(_sq_tail, _sq_local_tail);
+                if(_sq_submitted != _sq_local_tail)
+                {
+                    const int n = ring_enter(_fd, _sq_local_tail - _sq_submitted, 0, IORING_ENTER_GETEVENTS);
+                    if(n > 0) _sq_submitted += n;
+                    else if(n < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) return false;
+                }
+                else if(load_acquire(_sq_flags) & IORING_SQ_CQ_OVERFLOW) 
+                    ring_enter(_fd, 0, 0, IORING_ENTER_GETEVENTS);
+
+                //completions are dropped, whoever would handle them is going away
+                bool progress = false;
+                unsigned head = *_cq_head;
+                for(const unsigned tail = load_acquire(_cq_tail); head != tail; head++)
+                {
+                    const auto& cqe = _cqes[head & _cq_mask];
+                    progress = true;
+                    if(cqe.user_data == CANCEL_TAG) 
+                    {
+                        //something slipped past the cancel, try again a few times
+                        cancelling = false;
+                        tries++;
+                    }
+                    else if(cqe.user_data != RECV_TAG || !(cqe.flags & IORING_CQE_F_MORE)) _in_flight--;
+                }
+                store_release(_cq_head, head);
+                if(_in_flight == 0) break;
+                if(tries > DRAIN_TRIES) return false;
+                if(progress) continue;
+
+                tries++;
+                pollfd p{_fd, POLLIN, 0};
+                ::poll(&p, 1, DRAIN_WAIT);
+            }
+            return true;
+        }
+
+        bool udp_ring::ok() const
+        {
+            return _ok;
+        }
+
+        bool udp_ring::failed() const
+        {
+            return _failed;
+        }
+
+        bool udp_ring::start()
+        {
+            REQUIRE(_ok);
+            return arm_receive() && submit();
+        }
+
+        io_uring_sqe* udp_ring::next_sqe()
+        {
+            if(_sq_local_tail - load_acquire(_sq_head) >= _sq_entries) return nullptr;
+
+            const unsigned i = _sq_local_tail & _sq_mask;
+            _sq_array[i] = i;
+            _sq_local_tail++;
+
+            auto* sqe = &_sqes[i];
+            std::memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        bool udp_ring::arm_receive()
+        {
+            auto* sqe = next_sqe();
+            if(!sqe) return false;
+
+            //stays armed, posting a completion per datagram until it runs out of buffers
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = _socket;
+            sqe->addr = reinterpret_cast<uint64_t>(&_recv_msg);
+            sqe->len = 1;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = RECV_GROUP;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = RECV_TAG;
+            _rearm = false;
+            _in_flight++;
+            return true;
+        }
+
+        bool udp_ring::queue_send(size_t slot, const util::bytes& data, const udp::endpoint& to)
+        {
+            REQUIRE(_ok);
+            REQUIRE_LESS(slot, _send_msgs.size());
+
+            auto* sqe = next_sqe();
+            if(!sqe) return false;
+
+            auto& iov = _send_iovs[slot];
+            iov.iov_base = const_cast<char*>(data.data());
+            iov.iov_len = data.size();
+
+            auto& m = _send_msgs[slot];
+            std::memset(&m, 0, sizeof(m));
+            m.msg_name = const_cast<sockaddr*>(to.data());
+            m.msg_namelen = to.size();
+            m.msg_iov = &iov;
+            m.msg_iovlen = 1;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = _socket;
+            sqe->addr = reinterpret_cast<uint64_t>(&m);
+            sqe->len = 1;
+            sqe->user_data = slot;
+            _in_flight++;
+            return true;
+        }
+
+        bool udp_ring::submit()
+        {
+            if(!_ok) return false;
+
+            store_release(_sq_tail, _sq_local_tail);
+            while(_sq_submitted != _sq_local_tail)
+            {
+                const int n = ring_enter(_fd, _sq_local_tail - _sq_submitted, 0, 0);
+                if(n > 0)
+                {
+                    _sq_submitted += n;
+                    continue;
+                }
+
+                const int err = n < 0 ? errno : EAGAIN;
+                if(err == EINTR) continue;
+
+                //completions are backed up, what is left goes after the next reap
+                if(err == EBUSY || err == EAGAIN) return true;
+
+                LOG << "io_uring submit failed: " << std::strerror(err) << std::endl;
+                _failed = true;
+                return false;
+            }
+            return true;
+        }
+
+        size_t udp_ring::reap()
+        {
+            //a handler that ends up here again leaves the rest to the outer loop
+            if(!_ok || _reaping) return 0;
+            _reaping = true;
+
+            size_t n = 0;
+            while(true)
+            {
+                unsigned head = *_cq_head;
+                const unsigned tail = load_acquire(_cq_tail);
+                if(head == tail) 
+                {
+                    //completions the kernel held back when the ring was full
+                    if(!(load_acquire(_sq_flags) & IORING_SQ_CQ_OVERFLOW)) break;
+                    if(ring_enter(_fd, 0, 0, IORING_ENTER_GETEVENTS) < 0) break;
+                    continue;
+                }
+
+                for(; head != tail; head++, n++)
+                {
+                    const auto& cqe = _cqes[head & _cq_mask];
+                    if(cqe.user_data != RECV_TAG || !(cqe.flags & IORING_CQE_F_MORE)) _in_flight--;
+                    if(cqe.user_data == RECV_TAG) received(cqe);
+                    else _on_sent(cqe.user_data, cqe.res);
+                }
+                store_release(_cq_head, head);
+            }
+
+            _reaping = false;
+
+            publish_buffers();
+            if(_ok && !_failed)
+            {
+                if(_rearm) arm_receive();
+                if(_sq_submitted != _sq_local_tail) submit();
+            }
+            return n;
+        }
+
+        void udp_ring::received(const io_uring_cqe& cqe)
+        {
+            if(!(cqe.flags & IORING_CQE_F_MORE)) _rearm = true;
+
+            if(cqe.res < 0)
+            {
+                const int err = -cqe.res;
+
+                //out of buffers, picked up again once they are recycled
+                if(err == ENOBUFS) return;
+                if(err == ECANCELED) 
+                {
+                    _rearm = false;
+                    return;
+                }
+
+                //kernel too old for multishot receive
+                if(err == EINVAL || err == EOPNOTSUPP) _failed = true;
+                LOG << "io_uring udp receive failed: " << std::strerror(err) << std::endl;
+                return;
+            }
+
+            if(!(cqe.flags & IORING_CQE_F_BUFFER)) return;
+            const unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            CHECK_LESS(bid, RECV_BUFFERS);
+
+            const char* b = _buffers + bid * _buffer_size;
+            const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(b);
+            const char* name = b + sizeof(io_uring_recvmsg_out);
+            const char* payload = name + _recv_msg.msg_namelen + _recv_msg.msg_controllen;
+
+            udp::endpoint from;
+            const bool usable = 
+                !(out->flags & MSG_TRUNC) && 
+                out->namelen <= from.capacity() &&
+                payload + out->payloadlen <= b + cqe.res;
+
+            if(usable)
+            {
+                std::memcpy(from.data(), name, out->namelen);
+                from.resize(out->namelen);
+                _on_datagram(payload, out->payloadlen, from);
+            }
+
+            recycle(bid);
+        }
+
+        void udp_ring::recycle(unsigned short bid)
+        {
+            //entries start at the top of the ring. the header's flexible array 
+            //member sits a few bytes later when compiled as c++
+            auto* bufs = reinterpret_cast<io_uring_buf*>(_buf_ring);
+            auto& b = bufs[(_buf_tail + _buf_added) & (RECV_BUFFERS - 1)];
+            b.addr = reinterpret_cast<uint64_t>(_buffers + bid * _buffer_size);
+            b.len = _buffer_size;
+            b.bid = bid;
+            _buf_added++;
+        }
+
+        void udp_ring::publish_buffers()
+        {
+            if(_buf_added == 0) return;
+
+            _buf_tail += _buf_added;
+            _buf_added = 0;
+            store_release(&_buf_ring->tail, _buf_tail);
+        }
+
+        void udp_ring::wait(std::function<void(const boost::system::error_code&)> h)
+        {
+            REQUIRE(h);
+            if(!_event.is_open()) return;
+
+            //drain the eventfd count before the reap it triggers
+            _event.async_wait(ba::posix::stream_descriptor::wait_read, 
+                    [this, h](const boost::system::error_code& error)
+                    {
+                        uint64_t count = 0;
+                        if(!error && ::read(_event.native_handle(), &count, sizeof(count)) < 0) count = 0;
+                        h(error);
+                    });
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_UDP_RING_H
+#define FIRESTR_NETWORK_UDP_RING_H
+
+#include "util/bytes.hpp"
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <boost/asio.hpp>
+
+//io_uring for udp where the kernel headers know multishot receive.
+//whether the running kernel allows it is checked when the ring is made
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define FIRESTR_UDP_URING
+#endif
+#endif
+#endif
+
+#ifdef FIRESTR_UDP_URING
+
+#include <sys/socket.h>
+
+namespace fire
+{
+    namespace network
+    {
+        using ring_datagram_handler = std::function<void(const char* data, size_t size, const boost::asio::ip::udp::endpoint& from)>;
+
+        //result is bytes sent or a negative errno
+        using ring_sent_handler = std::function<void(size_t slot, int result)>;
+
+        //a udp socket driven through an io_uring. datagrams land in buffers 
+        //registered with the kernel by one multishot receive, and sends are 
+        //queued into slots and submitted together. completions are reaped on 
+        //the io_service thread when the ring's eventfd wakes it. the kernel 
+        //finishes requests on the thread that submitted them, so everything 
+        //past construction happens on the io_service thread.
+        class udp_ring
+        {
+            public:
+                udp_ring(
+                        boost::asio::io_service& io, 
+                        int socket, 
+                        size_t max_datagram,
+                        size_t send_slots,
+                        ring_datagram_handler on_datagram,
+                        ring_sent_handler on_sent);
+                ~udp_ring();
+
+            public:
+                bool ok() const;
+                bool failed() const;
+                bool start();
+                bool queue_send(size_t slot, const util::bytes& data, const boost::asio::ip::udp::endpoint& to);
+                bool submit();
+                size_t reap();
+                void wait(std::function<void(const boost::system::error_code&)> h);
+                void close();
+
+            private:
+                bool setup();
+                bool setup_buffers(size_t max_datagram);
+                bool supported_ops();
+                io_uring_sqe* next_sqe();
+                bool arm_receive();
+                void received(const io_uring_cqe&);
+                void recycle(unsigned short bid);
+                void publish_buffers();
+                bool drain();
+                void unmap();
+
+            private:
+                int _fd = -1;
+                int _socket;
+                bool _ok = false;
+                bool _failed = false;
+                bool _rearm = false;
+                bool _reaping = false;
+
+                //submission and completion rings shared with the kernel
+                void* _rings = nullptr;
+                size_t _rings_size = 0;
+                io_uring_sqe* _sqes = nullptr;
+                size_t _sqes_size = 0;
+                unsigned* _sq_head = nullptr;
+                unsigned* _sq_tail = nullptr;
+                unsigned* _sq_flags = nullptr;
+                unsigned* _sq_array = nullptr;
+                unsigned _sq_mask = 0;
+                unsigned _sq_entries = 0;
+                unsigned _sq_local_tail = 0; //prepared but not yet submitted
+                unsigned _sq_submitted = 0;
+                unsigned _in_flight = 0; //requests yet to post their last completion
+                unsigned* _cq_head = nullptr;
+                unsigned* _cq_tail = nullptr;
+                io_uring_cqe* _cqes = nullptr;
+                unsigned _cq_mask = 0;
+
+                //receive buffers the kernel picks from
+                io_uring_buf_ring* _buf_ring = nullptr;
+                size_t _buf_ring_size = 0;
+                char* _buffers = nullptr;
+                size_t _buffers_size = 0;
+                size_t _buffer_size = 0; //of each one
+                unsigned short _buf_tail = 0;
+                unsigned short _buf_added = 0;
+                msghdr _recv_msg;
+
+                //sends stay in their slot until the kernel is done with them
+                std::vector<msghdr> _send_msgs;
+                std::vector<iovec> _send_iovs;
+
+                boost::asio::posix::stream_descriptor _event;
+                ring_datagram_handler _on_datagram;
+                ring_sent_handler _on_sent;
+        };
+
+        using udp_ring_ptr = std::unique_ptr<udp_ring>;
+    }
+}
+
+#endif
+#endif